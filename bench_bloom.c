@@ -0,0 +1,754 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bloom.h"
+
+// Keys are generated in chunks outside the timed region, so no key array proportional to n is ever held
+#define bench_chunk 4096U
+#define bench_build_chunk (1U << 20)
+#define bench_attach_rounds 1000
+#define bench_max_list 16
+#define bench_max_threads 256
+
+typedef struct bench_config {
+	uint64_t min_n;
+	uint64_t max_n;
+	uint64_t num_ops;
+	uint64_t num_samples;
+	int num_threads;
+	double p[bench_max_list];
+	int num_p;
+	double key_sizes[bench_max_list];
+	int num_key_sizes;
+	double hit_ratios[bench_max_list];
+	int num_hit_ratios;
+	int layouts;
+	int pages;
+	uint32_t hash_id;
+	uint64_t llc_size;
+	uint64_t fpr_bits;
+	double timer_overhead;
+	int tlb_fd;
+} bench_config;
+
+typedef struct bench_thread_arg {
+	bloom *bf;
+	pthread_barrier_t *barrier;
+	uint32_t key_size;
+	int add;
+	uint64_t n;
+	uint64_t start;
+	uint64_t count;
+	uint64_t num_samples;
+	double hit_ratio;
+	double *latencies;
+	uint64_t num_latencies;
+	uint64_t misses;
+	uint64_t false_positives;
+	double elapsed;
+} bench_thread_arg;
+
+static bool bench_first_result = true;
+
+double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t bench_mix(uint64_t x)
+{
+	// splitmix64 finaliser
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Key x is a deterministic function of its index, so the test phase can regenerate inserted keys (x < n)
+// and keys that were never inserted (x >= n) without storing them.
+static void bench_make_key(uint8_t *key, uint32_t key_size, uint64_t x)
+{
+	for (uint32_t off = 0, w = 0; off < key_size; off += 8, w++) {
+		uint64_t word = bench_mix(x * 0x100000001B3ULL + w);
+		memcpy(key + off, &word, key_size - off < 8 ? key_size - off : 8);
+	}
+}
+
+// Index of the key for test operation j: a hit_ratio share of inserted keys, the rest never inserted
+static inline uint64_t bench_test_index(uint64_t j, uint64_t n, double hit_ratio, bool *hit)
+{
+	uint64_t h = bench_mix(j ^ 0xD1B54A32D192ED03ULL);
+	*hit = (double) (h >> 11) * 0x1.0p-53 < hit_ratio;
+	return *hit ? h % n : n + j;
+}
+
+double bench_timer_overhead(void)
+{
+	double best = 1.0;
+	for (int i = 0; i < 1000; i++) {
+		double start = bench_now();
+		double t = bench_now() - start;
+		if (t < best) {
+			best = t;
+		}
+	}
+	return best;
+}
+
+// Counts data TLB read misses of this process and of the threads it creates, -1 where the PMU is not available
+int bench_tlb_open(void)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HW_CACHE,
+		.size = sizeof attr,
+		.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+		.inherit = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Counts of exited threads are folded into the parent, so this is read after the workers are joined
+uint64_t bench_tlb_read(bench_config *cfg)
+{
+	uint64_t count = 0;
+	if (cfg->tlb_fd >= 0 && read(cfg->tlb_fd, &count, sizeof count) != sizeof count) {
+		count = 0;
+	}
+	return count;
+}
+
+void *bench_worker(void *arg)
+{
+	bench_thread_arg *t = arg;
+	uint8_t *keys = malloc((uint64_t) bench_chunk * t->key_size);
+	uint8_t *hits = malloc(bench_chunk);
+	if (!keys || !hits) {
+		fprintf(stderr, "fatal malloc error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Adds time every key in bulk except the last num_samples, which are timed one by one for the
+	// percentiles. Tests run the bulk pass over all keys and then a separate sampled pass.
+	uint64_t bulk = t->add ? t->count - t->num_samples : t->count;
+	pthread_barrier_wait(t->barrier);
+	double elapsed = 0;
+	for (uint64_t done = 0; done < bulk; done += bench_chunk) {
+		uint32_t chunk = bulk - done < bench_chunk ? bulk - done : bench_chunk;
+		for (uint32_t i = 0; i < chunk; i++) {
+			bool hit = true;
+			uint64_t x = t->add ? t->start + done + i :
+			             bench_test_index(t->start + done + i, t->n, t->hit_ratio, &hit);
+			bench_make_key(keys + (uint64_t) i * t->key_size, t->key_size, x);
+			hits[i] = hit;
+		}
+
+		uint8_t *key = keys;
+		double start = bench_now();
+		if (t->add) {
+			for (uint32_t i = 0; i < chunk; i++, key += t->key_size) {
+				bloom_add(t->bf, key, t->key_size);
+			}
+		} else {
+			for (uint32_t i = 0; i < chunk; i++, key += t->key_size) {
+				// bloom_test returns 0 when the key may be present
+				uint64_t positive = !bloom_test(t->bf, key, t->key_size);
+				t->misses += !hits[i];
+				t->false_positives += positive & !hits[i];
+			}
+		}
+		elapsed += bench_now() - start;
+	}
+	t->elapsed = elapsed;
+
+	uint8_t *key = keys;
+	for (uint64_t i = 0; i < t->num_samples; i++) {
+		bool hit = true;
+		uint64_t x = t->add ? t->start + bulk + i :
+		             bench_test_index(t->start + t->count + i, t->n, t->hit_ratio, &hit);
+		bench_make_key(key, t->key_size, x);
+		double start = bench_now();
+		if (t->add) {
+			bloom_add(t->bf, key, t->key_size);
+		} else {
+			bloom_test(t->bf, key, t->key_size);
+		}
+		t->latencies[t->num_latencies++] = bench_now() - start;
+	}
+
+	free(keys);
+	free(hits);
+	return NULL;
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double bench_percentile(double *sorted, uint64_t len, double q)
+{
+	return sorted[(uint64_t) (q * (len - 1))];
+}
+
+void bench_emit(bench_config *cfg, bloom *bf, const char *op, uint64_t n, double p, uint32_t key_size,
+                int threads, double hit_ratio, uint64_t ops, double seconds, double *latencies,
+                uint64_t num_latencies, uint64_t misses, uint64_t false_positives, uint64_t tlb_misses,
+                double per_key_ns)
+{
+	static const char *pages[] = {"4k", "thp", "2m", "1g"};
+	printf("%s\n    {\"op\": \"%s\", \"layout\": \"%s\", \"n\": %lu, \"p\": %g, \"key_size\": %u, \"threads\": %d, ",
+	       bench_first_result ? "" : ",", op,
+	       bf->flags & BLOOM_BLOCKED ? "blocked" : bf->flags & BLOOM_LARGE ? "large" : bf->flags & BLOOM_ALIGN_WORDS ?
+	       "words" : bf->flags & BLOOM_ALIGN_LINES ? "lines" : bf->flags & BLOOM_COUNTING ? "counting" : "classic", n,
+	       p, key_size, threads);
+	bench_first_result = false;
+	if (hit_ratio >= 0) {
+		printf("\"hit_ratio\": %g, ", hit_ratio);
+	}
+	printf("\"filter_bytes\": %lu, \"residency\": \"%s\", \"pages\": \"%s\", \"ops\": %lu, \"seconds\": %.6f, ",
+	       bf->size, bf->size <= cfg->llc_size ? "cache" : "dram", pages[bf->pages], ops, seconds);
+	// ns_per_op is wall time per operation across all threads, the reciprocal of ops_per_sec
+	printf("\"ns_per_op\": %.2f, \"ops_per_sec\": %.0f", seconds * 1e9 / ops, ops / seconds);
+
+	if (num_latencies) {
+		static const char *names[] = {"p50", "p90", "p99", "p999"};
+		static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+		qsort(latencies, num_latencies, sizeof *latencies, bench_compare_double);
+		for (int i = 0; i < 4; i++) {
+			double ns = (bench_percentile(latencies, num_latencies, quantiles[i]) - cfg->timer_overhead) * 1e9;
+			printf(", \"%s_ns\": %.1f", names[i], ns > 0 ? ns : 0);
+		}
+		printf(", \"latency_samples\": %lu", num_latencies);
+	}
+	if (misses) {
+		printf(", \"fpr\": %g", (double) false_positives / misses);
+	}
+	if (cfg->tlb_fd >= 0) {
+		printf(", \"dtlb_misses_per_op\": %.4f", (double) tlb_misses / ops);
+	}
+	// Batch records compare against the per-key record of the same configuration
+	if (per_key_ns > 0) {
+		printf(", \"speedup_vs_per_key\": %.2f", per_key_ns / (seconds * 1e9 / ops));
+	}
+	printf("}");
+	fflush(stdout);
+}
+
+// Runs one add or test phase over a filter with num_threads workers and returns the wall time
+double bench_phase(bench_config *cfg, bench_thread_arg *args, bloom *bf, int add, uint64_t n,
+                   uint32_t key_size, int num_threads, uint64_t ops, double hit_ratio, double *latencies)
+{
+	pthread_t threads[bench_max_threads];
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, num_threads);
+
+	uint64_t per_thread = ops / num_threads;
+	// Sampled adds come out of each thread's share, so keep at least half of it in the bulk pass
+	uint64_t samples = cfg->num_samples / num_threads;
+	if (add && samples > per_thread / 2) {
+		samples = per_thread / 2;
+	}
+	for (int i = 0; i < num_threads; i++) {
+		args[i] = (bench_thread_arg) {
+			.bf = bf,
+			.barrier = &barrier,
+			.key_size = key_size,
+			.add = add,
+			.n = n,
+			.start = i * per_thread,
+			.count = i == num_threads - 1 ? ops - i * per_thread : per_thread,
+			.num_samples = samples,
+			.hit_ratio = hit_ratio,
+			.latencies = latencies + i * samples,
+		};
+		pthread_create(&threads[i], NULL, bench_worker, &args[i]);
+	}
+
+	double wall = 0;
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+		if (args[i].elapsed > wall) {
+			wall = args[i].elapsed;
+		}
+	}
+	pthread_barrier_destroy(&barrier);
+	return wall;
+}
+
+// Operations timed by bench_batch. The ones that insert run over keys 0..ops, like the add phase, the tests
+// over the bench_test_index mix of inserted and never inserted keys.
+enum {
+	bench_op_add,
+	bench_op_test,
+	bench_op_test_and_add,
+	bench_op_add_fixed,
+	bench_op_test_fixed,
+	bench_op_remove,
+};
+
+// Batch operations run single threaded over bench_chunk keys at a time; only throughput is reported
+double bench_batch(bloom *bf, int op, uint64_t n, uint32_t key_size, uint64_t ops, double hit_ratio,
+                   uint64_t *misses, uint64_t *false_positives)
+{
+	uint8_t *keys = malloc((uint64_t) bench_chunk * key_size);
+	uint8_t *hits = malloc(bench_chunk);
+	uint8_t *results = malloc(bench_chunk);
+	uint64_t *offsets = malloc((bench_chunk + 1) * sizeof *offsets);
+	if (!keys || !hits || !results || !offsets) {
+		fprintf(stderr, "fatal malloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (uint64_t i = 0; i <= bench_chunk; i++) {
+		offsets[i] = i * key_size;
+	}
+
+	bool test = op == bench_op_test || op == bench_op_test_fixed;
+	double elapsed = 0;
+	for (uint64_t done = 0; done < ops; done += bench_chunk) {
+		uint32_t chunk = ops - done < bench_chunk ? ops - done : bench_chunk;
+		for (uint32_t i = 0; i < chunk; i++) {
+			bool hit = true;
+			uint64_t x = test ? bench_test_index(done + i, n, hit_ratio, &hit) : done + i;
+			bench_make_key(keys + (uint64_t) i * key_size, key_size, x);
+			hits[i] = hit;
+		}
+
+		double start = bench_now();
+		switch (op) {
+		case bench_op_add: bloom_add_batch(bf, keys, offsets, chunk); break;
+		case bench_op_test: bloom_test_batch(bf, keys, offsets, chunk, results); break;
+		case bench_op_test_and_add: bloom_test_and_add_batch(bf, keys, offsets, chunk, results); break;
+		case bench_op_add_fixed: bloom_add_batch_fixed(bf, keys, key_size, chunk); break;
+		case bench_op_test_fixed: bloom_test_batch_fixed(bf, keys, key_size, chunk, results); break;
+		default:
+			for (uint32_t i = 0; i < chunk; i++) {
+				bloom_remove(bf, keys + offsets[i], key_size);
+			}
+		}
+		elapsed += bench_now() - start;
+
+		for (uint32_t i = 0; test && i < chunk; i++) {
+			*misses += !hits[i];
+			*false_positives += !results[i] & !hits[i];
+		}
+	}
+
+	free(keys);
+	free(hits);
+	free(results);
+	free(offsets);
+	return elapsed;
+}
+
+// Builds the filter from n keys with bloom_build_parallel, handing it bench_build_chunk keys per call so
+// the key array stays bounded; returns the wall time of the builds
+double bench_build(bloom *bf, uint64_t n, uint32_t key_size, int num_threads)
+{
+	uint64_t max_chunk = n < bench_build_chunk ? n : bench_build_chunk;
+	uint8_t *keys = malloc(max_chunk * key_size);
+	uint64_t *offsets = malloc((max_chunk + 1) * sizeof *offsets);
+	if (!keys || !offsets) {
+		fprintf(stderr, "fatal malloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (uint64_t i = 0; i <= max_chunk; i++) {
+		offsets[i] = i * key_size;
+	}
+
+	double elapsed = 0;
+	for (uint64_t done = 0; done < n; done += max_chunk) {
+		uint64_t chunk = n - done < max_chunk ? n - done : max_chunk;
+		for (uint64_t i = 0; i < chunk; i++) {
+			bench_make_key(keys + i * key_size, key_size, done + i);
+		}
+		double start = bench_now();
+		if (bloom_build_parallel(bf, keys, offsets, chunk, num_threads)) {
+			fprintf(stderr, "parallel build failed (n %lu)\n", n);
+			exit(EXIT_FAILURE);
+		}
+		elapsed += bench_now() - start;
+	}
+
+	free(keys);
+	free(offsets);
+	return elapsed;
+}
+
+// Times attaching to an existing array from its layout, which is what a reader of a shared filter pays
+double bench_attach(bloom *bf, uint64_t rounds)
+{
+	bloom_header layout = {
+		.flags = bf->flags,
+		.hash_id = bf->hash_id,
+		.hash_seed = bf->hash_seed,
+		.false_pos_rate = bf->false_pos_rate,
+		.capacity = bf->capacity,
+		.num_partitions = bf->num_partitions,
+		.num_blocks = bf->num_blocks,
+		.size = bf->size,
+	};
+	bloom attached;
+	double start = bench_now();
+	for (uint64_t i = 0; i < rounds; i++) {
+		if (bloom_init_layout(&attached, &layout, bf->partition_lengths, bf->base_ptr, bf->total_size)) {
+			fprintf(stderr, "attach failed\n");
+			exit(EXIT_FAILURE);
+		}
+		bloom_clear(&attached);
+	}
+	return bench_now() - start;
+}
+
+bloom *bench_alloc(bench_config *cfg, double p, uint64_t n, uint32_t flags)
+{
+	bloom *bf = bloom_alloc_ex(p, n, NULL, 0, flags);
+	if (!bf || bloom_use_hash(bf, cfg->hash_id, 0)) {
+		fprintf(stderr, "failed to allocate filter (n %lu, p %g)\n", n, p);
+		exit(EXIT_FAILURE);
+	}
+	return bf;
+}
+
+void bench_run(bench_config *cfg, uint64_t n, double p, uint32_t key_size, uint32_t flags, int num_threads,
+               double *latencies)
+{
+	bench_thread_arg args[bench_max_threads];
+	uint64_t misses = 0, false_positives = 0;
+	if (num_threads > 1) {
+		flags |= BLOOM_CONCURRENT;
+	}
+
+	// Fill the filter to capacity, so tests run against the occupancy it was sized for
+	double seconds = bench_now();
+	bloom *bf = bench_alloc(cfg, p, n, flags);
+	seconds = bench_now() - seconds;
+	if (num_threads == 1) {
+		bench_emit(cfg, bf, "init", n, p, key_size, 1, -1, 1, seconds, NULL, 0, 0, 0, 0, 0);
+	}
+	// TLB misses are counted over whole phases, including key generation, which is the same for every filter
+	uint64_t tlb = bench_tlb_read(cfg);
+	seconds = bench_phase(cfg, args, bf, 1, n, key_size, num_threads, n, -1, latencies);
+	tlb = bench_tlb_read(cfg) - tlb;
+	uint64_t bulk = 0, num_latencies = 0;
+	for (int i = 0; i < num_threads; i++) {
+		bulk += args[i].count - args[i].num_samples;
+		num_latencies += args[i].num_latencies;
+	}
+	bench_emit(cfg, bf, "add", n, p, key_size, num_threads, -1, bulk, seconds, latencies, num_latencies, 0, 0,
+	           tlb, 0);
+	double add_ns = seconds * 1e9 / bulk;
+
+	if (num_threads == 1) {
+		static const int ops[] = {bench_op_add, bench_op_add_fixed, bench_op_test_and_add};
+		static const char *names[] = {"add_batch", "add_batch_fixed", "test_and_add_batch"};
+		for (int op = 0; op < 3; op++) {
+			bloom *batch_bf = bench_alloc(cfg, p, n, flags);
+			tlb = bench_tlb_read(cfg);
+			seconds = bench_batch(batch_bf, ops[op], n, key_size, n, -1, &misses, &false_positives);
+			tlb = bench_tlb_read(cfg) - tlb;
+			bench_emit(cfg, batch_bf, names[op], n, p, key_size, 1, -1, n, seconds, NULL, 0, 0, 0, tlb,
+			           ops[op] != bench_op_test_and_add ? add_ns : 0);
+
+			// The union streams both inputs and the destination, and is reported per byte of all three
+			bloom *dst = op ? NULL : bench_alloc(cfg, p, n, flags);
+			if (dst) {
+				seconds = bench_now();
+				int res = bloom_union(dst, bf, batch_bf);
+				seconds = bench_now() - seconds;
+				if (!res) {
+					bench_emit(cfg, dst, "union", n, p, key_size, 1, -1, 3 * bf->size, seconds, NULL, 0, 0, 0, 0, 0);
+				}
+				bloom_free(dst);
+			}
+			bloom_free(batch_bf);
+		}
+
+		seconds = bench_attach(bf, bench_attach_rounds);
+		bench_emit(cfg, bf, "attach", n, p, key_size, 1, -1, bench_attach_rounds, seconds, NULL, 0, 0, 0, 0, 0);
+		seconds = bench_now();
+		bloom_estimate_count(bf);
+		seconds = bench_now() - seconds;
+		bench_emit(cfg, bf, "estimate", n, p, key_size, 1, -1, 1, seconds, NULL, 0, 0, 0, 0, 0);
+	} else {
+		bloom *build_bf = bench_alloc(cfg, p, n, flags);
+		tlb = bench_tlb_read(cfg);
+		seconds = bench_build(build_bf, n, key_size, num_threads);
+		tlb = bench_tlb_read(cfg) - tlb;
+		bench_emit(cfg, build_bf, "build_parallel", n, p, key_size, num_threads, -1, n, seconds, NULL, 0, 0, 0, tlb, 0);
+		bloom_free(build_bf);
+	}
+
+	for (int h = 0; h < cfg->num_hit_ratios; h++) {
+		double hit_ratio = cfg->hit_ratios[h];
+		tlb = bench_tlb_read(cfg);
+		seconds = bench_phase(cfg, args, bf, 0, n, key_size, num_threads, cfg->num_ops, hit_ratio, latencies);
+		tlb = bench_tlb_read(cfg) - tlb;
+		num_latencies = misses = false_positives = 0;
+		for (int i = 0; i < num_threads; i++) {
+			num_latencies += args[i].num_latencies;
+			misses += args[i].misses;
+			false_positives += args[i].false_positives;
+		}
+		bench_emit(cfg, bf, "test", n, p, key_size, num_threads, hit_ratio, cfg->num_ops, seconds, latencies,
+		           num_latencies, misses, false_positives, tlb, 0);
+		double test_ns = seconds * 1e9 / cfg->num_ops;
+
+		static const int ops[] = {bench_op_test, bench_op_test_fixed};
+		static const char *names[] = {"test_batch", "test_batch_fixed"};
+		for (int op = 0; op < 2 && num_threads == 1; op++) {
+			misses = false_positives = 0;
+			tlb = bench_tlb_read(cfg);
+			seconds = bench_batch(bf, ops[op], n, key_size, cfg->num_ops, hit_ratio, &misses, &false_positives);
+			tlb = bench_tlb_read(cfg) - tlb;
+			bench_emit(cfg, bf, names[op], n, p, key_size, 1, hit_ratio, cfg->num_ops, seconds, NULL, 0, misses,
+			           false_positives, tlb, test_ns);
+		}
+	}
+
+	if (flags & BLOOM_COUNTING) {
+		tlb = bench_tlb_read(cfg);
+		seconds = bench_batch(bf, bench_op_remove, n, key_size, n, -1, &misses, &false_positives);
+		tlb = bench_tlb_read(cfg) - tlb;
+		bench_emit(cfg, bf, "remove", n, p, key_size, 1, -1, n, seconds, NULL, 0, 0, 0, tlb, 0);
+	}
+	bloom_free(bf);
+}
+
+// Fills a BLOOM_LARGE filter of about bits bits to capacity and measures its false positive rate on never
+// inserted keys, which is the only check of the 128 bit hash at the sizes it is meant for
+void bench_fpr_check(bench_config *cfg, uint64_t bits, double p, uint32_t key_size, uint32_t flags,
+                     double *latencies)
+{
+	bench_thread_arg args[bench_max_threads];
+	int num_threads = cfg->num_threads;
+	// Inverse of the sizing in bloom_plan, m = -n ln p / ln^2 2
+	uint64_t n = ceil(bits * log(2) * log(2) / -log(p));
+	flags |= BLOOM_LARGE | (num_threads > 1 ? BLOOM_CONCURRENT : 0);
+
+	double seconds = bench_now();
+	bloom *bf = bench_alloc(cfg, p, n, flags);
+	seconds = bench_now() - seconds;
+	bench_emit(cfg, bf, "init", n, p, key_size, 1, -1, 1, seconds, NULL, 0, 0, 0, 0, 0);
+	seconds = bench_phase(cfg, args, bf, 1, n, key_size, num_threads, n, -1, latencies);
+	bench_emit(cfg, bf, "add", n, p, key_size, num_threads, -1, n, seconds, NULL, 0, 0, 0, 0, 0);
+
+	seconds = bench_phase(cfg, args, bf, 0, n, key_size, num_threads, cfg->num_ops, 0, latencies);
+	uint64_t misses = 0, false_positives = 0;
+	for (int i = 0; i < num_threads; i++) {
+		misses += args[i].misses;
+		false_positives += args[i].false_positives;
+	}
+	bench_emit(cfg, bf, "fpr_check", n, p, key_size, num_threads, 0, cfg->num_ops, seconds, NULL, 0, misses,
+	           false_positives, 0, 0);
+	bloom_free(bf);
+}
+
+int bench_parse_list(const char *arg, double *list, int *len)
+{
+	char *end;
+	*len = 0;
+	while (*arg && *len < bench_max_list) {
+		list[(*len)++] = strtod(arg, &end);
+		if (end == arg || (*end && *end != ',')) {
+			return -1;
+		}
+		arg = *end ? end + 1 : end;
+	}
+	return *len ? 0 : -1;
+}
+
+// Comma separated layouts, as a mask of 1 classic, 2 blocked, 4 large (classic with BLOOM_LARGE), 8 words
+// and 16 lines (classic with BLOOM_ALIGN_WORDS or BLOOM_ALIGN_LINES) and 32 counting (BLOOM_COUNTING)
+int bench_parse_layouts(const char *arg, int *layouts)
+{
+	static const char *names[] = {"classic", "blocked", "large", "words", "lines", "counting", "both"};
+	static const int masks[] = {1, 2, 4, 8, 16, 32, 3};
+	*layouts = 0;
+	while (*arg) {
+		size_t len = strcspn(arg, ",");
+		int i = 0;
+		while (i < 7 && (strlen(names[i]) != len || strncmp(arg, names[i], len))) {
+			i++;
+		}
+		if (i == 7) {
+			return -1;
+		}
+		*layouts |= masks[i];
+		arg += arg[len] ? len + 1 : len;
+	}
+	return *layouts ? 0 : -1;
+}
+
+uint64_t bench_llc_size(void)
+{
+	long size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+	size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (size <= 0) {
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	}
+#endif
+	return size > 0 ? (uint64_t) size : 32ULL << 20;
+}
+
+void bench_usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -n MIN        smallest n in the sweep (default 1000)\n"
+	        "  -N MAX        largest n in the sweep, stepping by 10x (default 10000000, up to 1000000000)\n"
+	        "  -p LIST       false positive rates (default 0.01,0.001)\n"
+	        "  -k LIST       key sizes in bytes (default 8,32,128)\n"
+	        "  -r LIST       hit ratios for tests (default 0,0.5,1)\n"
+	        "  -o OPS        test operations per run (default 1000000)\n"
+	        "  -s SAMPLES    individually timed operations per run for percentiles (default 100000)\n"
+	        "  -t THREADS    thread count for the multi-threaded runs, 1 to skip them (default: online CPUs)\n"
+	        "  -l LAYOUTS    classic, blocked, large (BLOOM_LARGE), words (BLOOM_ALIGN_WORDS), lines (BLOOM_ALIGN_LINES),\n"
+	        "                counting (BLOOM_COUNTING, single threaded) or both (classic,blocked), comma separated\n"
+	        "                (default both)\n"
+	        "  -P PAGES      4k, huge (BLOOM_HUGE_PAGES) or both (default 4k)\n"
+	        "  -H HASH       xxh64 or xxh3 (default xxh64)\n"
+	        "  -K KERNEL     batch kernel: scalar, avx2, avx512 or auto (default auto)\n"
+	        "  -c BYTES      cache size separating cache- from DRAM-resident filters (default: LLC size)\n"
+	        "  -F BITS       instead of the sweep, fill a large filter of about BITS bits (eg. 10000000000) for each\n"
+	        "                -p, with the first -k and -P, and report its false positive rate over -o absent keys\n",
+	        name);
+}
+
+int main(int argc, char **argv)
+{
+	static const double default_p[] = {0.01, 0.001};
+	static const double default_key_sizes[] = {8, 32, 128};
+	static const double default_hit_ratios[] = {0, 0.5, 1};
+	bench_config cfg = {
+		.min_n = 1000,
+		.max_n = 10000000,
+		.num_ops = 1000000,
+		.num_samples = 100000,
+		.num_threads = sysconf(_SC_NPROCESSORS_ONLN),
+		.num_p = 2,
+		.num_key_sizes = 3,
+		.num_hit_ratios = 3,
+		.layouts = 3,
+		.pages = 1,
+		.hash_id = BLOOM_HASH_DEFAULT,
+		.llc_size = bench_llc_size(),
+	};
+	memcpy(cfg.p, default_p, sizeof default_p);
+	memcpy(cfg.key_sizes, default_key_sizes, sizeof default_key_sizes);
+	memcpy(cfg.hit_ratios, default_hit_ratios, sizeof default_hit_ratios);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:N:p:k:r:o:s:t:l:P:H:K:c:F:h")) != -1) {
+		int err = 0;
+		switch (opt) {
+		case 'n': cfg.min_n = strtoull(optarg, NULL, 10); break;
+		case 'N': cfg.max_n = strtoull(optarg, NULL, 10); break;
+		case 'p': err = bench_parse_list(optarg, cfg.p, &cfg.num_p); break;
+		case 'k': err = bench_parse_list(optarg, cfg.key_sizes, &cfg.num_key_sizes); break;
+		case 'r': err = bench_parse_list(optarg, cfg.hit_ratios, &cfg.num_hit_ratios); break;
+		case 'o': cfg.num_ops = strtoull(optarg, NULL, 10); break;
+		case 's': cfg.num_samples = strtoull(optarg, NULL, 10); break;
+		case 't': cfg.num_threads = atoi(optarg); break;
+		case 'c': cfg.llc_size = strtoull(optarg, NULL, 10); break;
+		case 'F': cfg.fpr_bits = strtoull(optarg, NULL, 10); break;
+		case 'l': err = bench_parse_layouts(optarg, &cfg.layouts); break;
+		case 'P':
+			cfg.pages = !strcmp(optarg, "4k") ? 1 : !strcmp(optarg, "huge") ? 2 : !strcmp(optarg, "both") ? 3 : 0;
+			err = !cfg.pages;
+			break;
+		case 'H':
+			cfg.hash_id = !strcmp(optarg, "xxh64") ? BLOOM_HASH_XXH64 : !strcmp(optarg, "xxh3") ? BLOOM_HASH_XXH3 :
+			              BLOOM_HASH_MAX;
+			err = cfg.hash_id == BLOOM_HASH_MAX;
+			break;
+		case 'K':
+			// bloom_select_kernel refuses a kernel this CPU cannot run
+			err = bloom_select_kernel(!strcmp(optarg, "scalar") ? BLOOM_KERNEL_SCALAR :
+			                          !strcmp(optarg, "avx2") ? BLOOM_KERNEL_AVX2 :
+			                          !strcmp(optarg, "avx512") ? BLOOM_KERNEL_AVX512 :
+			                          !strcmp(optarg, "auto") ? BLOOM_KERNEL_AUTO : BLOOM_KERNEL_AVX512 + 1);
+			break;
+		default: err = 1;
+		}
+		if (err) {
+			bench_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (cfg.min_n < 2 || cfg.max_n < cfg.min_n || cfg.num_threads < 1 || cfg.num_threads > bench_max_threads ||
+	    cfg.num_ops < (uint64_t) cfg.num_threads) {
+		bench_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (cfg.num_samples > cfg.num_ops) {
+		cfg.num_samples = cfg.num_ops;
+	}
+	for (int i = 0; i < cfg.num_key_sizes; i++) {
+		if (cfg.key_sizes[i] < 1) {
+			bench_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	double *latencies = malloc(cfg.num_samples * sizeof *latencies);
+	if (!latencies) {
+		fprintf(stderr, "fatal malloc error\n");
+		return EXIT_FAILURE;
+	}
+	cfg.timer_overhead = bench_timer_overhead();
+	cfg.tlb_fd = bench_tlb_open();
+
+	static const char *kernels[] = {"scalar", "avx2", "avx512"};
+	printf("{\"machine\": {\"cpus\": %ld, \"llc_bytes\": %lu, \"kernel\": \"%s\", \"hash\": \"%s\", "
+	       "\"timer_overhead_ns\": %.1f, \"dtlb_counter\": %s},\n", sysconf(_SC_NPROCESSORS_ONLN), cfg.llc_size,
+	       kernels[bloom_active_kernel()], cfg.hash_id == BLOOM_HASH_XXH64 ? "xxh64" : "xxh3", cfg.timer_overhead * 1e9,
+	       cfg.tlb_fd >= 0 ? "true" : "false");
+	printf(" \"results\": [");
+
+	int thread_counts[] = {1, cfg.num_threads};
+	static const uint32_t layout_flags[] = {0, BLOOM_BLOCKED, BLOOM_LARGE, BLOOM_ALIGN_WORDS, BLOOM_ALIGN_LINES,
+	                                        BLOOM_COUNTING};
+	for (int i = 0; cfg.fpr_bits && i < cfg.num_p; i++) {
+		bench_fpr_check(&cfg, cfg.fpr_bits, cfg.p[i], cfg.key_sizes[0], cfg.pages & 1 ? 0 : BLOOM_HUGE_PAGES, latencies);
+	}
+	for (int layout = 0; layout < 6 && !cfg.fpr_bits; layout++) {
+		if (!(cfg.layouts & (1 << layout))) {
+			continue;
+		}
+		for (uint64_t n = cfg.min_n; n <= cfg.max_n; n = n > cfg.max_n / 10 ? cfg.max_n + 1 : n * 10) {
+			for (int i = 0; i < cfg.num_p; i++) {
+				for (int k = 0; k < cfg.num_key_sizes; k++) {
+					for (int pages = 0; pages < 2; pages++) {
+						if (!(cfg.pages & (1 << pages))) {
+							continue;
+						}
+						uint32_t flags = layout_flags[layout] | (pages ? BLOOM_HUGE_PAGES : 0);
+						// Counting filters cannot be shared between writers
+						int runs = cfg.num_threads > 1 && !(flags & BLOOM_COUNTING) ? 2 : 1;
+						for (int t = 0; t < runs; t++) {
+							bench_run(&cfg, n, cfg.p[i], cfg.key_sizes[k], flags, thread_counts[t], latencies);
+						}
+					}
+				}
+			}
+		}
+	}
+	printf("\n ]}\n");
+
+	if (cfg.tlb_fd >= 0) {
+		close(cfg.tlb_fd);
+	}
+	free(latencies);
+	return 0;
+}
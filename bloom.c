@@ -1,3 +1,17 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+// Inline xxhash here, so the short keys typical of filters do not pay for a call into the library
+#define XXH_INLINE_ALL
+#include "xxhash.h"
 #include "bloom.h"
 
 typedef struct prime_table {
@@ -5,77 +19,158 @@ typedef struct prime_table {
   uint64_t *primes;
 } prime_table;
 
-static inline int bloom_calc_partitions(bloom *bf, long target_size, long k, prime_table *primes);
+static inline int bloom_calc_partitions(bloom *bf, uint64_t target_size, uint64_t k);
+
+static inline int bloom_search_partitions(bloom *bf, uint64_t target_size, uint64_t k, prime_table *primes,
+                                          bool from_two);
+
+static inline int bloom_calc_blocks(double n, double p, prime_table *primes, uint64_t *k, uint64_t *first_prime,
+                                    uint64_t *num_blocks);
+
+static inline int bloom_layout_blocks(bloom *bf, prime_table *primes, uint64_t first_prime, uint64_t num_blocks);
+
+static inline int bloom_layout_partitions(bloom *bf);
+
+static inline int bloom_alloc_partitions(bloom *bf, uint64_t k);
+
+static inline int bloom_alloc_array(bloom *bf);
 
 static inline long binary_search_nearest(const uint64_t *elem_array, size_t num_elems, uint64_t value);
 
 static inline uint64_t unsigned_abs(uint64_t a, uint64_t b);
 
+static inline int generate_primes_range(prime_table *primes, uint64_t lo, uint64_t hi);
+
 static inline int generate_primes(prime_table *primes, double max);
 
-static inline int generate_primes(prime_table *primes, double max) {
-    if (!primes || max < 2) {
+// Key hashes as the probe functions take them. Only BLOOM_LARGE filters use the high 64 bits.
+typedef unsigned __int128 bloom_wide_hash;
+
+// Either partition alignment. Aligned filters are probed a 64 bit word at a time on little endian machines,
+// where bit b of a word is the same bit as in the byte-wise layout, so the array is the same either way.
+#define BLOOM_ALIGNED (BLOOM_ALIGN_WORDS | BLOOM_ALIGN_LINES)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BLOOM_WORD_PROBES BLOOM_ALIGNED
+#else
+#define BLOOM_WORD_PROBES 0
+#endif
+
+static inline uint64_t bloom_partition_bit(bloom *bf, bloom_wide_hash hash, uint64_t i);
+
+static inline uint64_t bloom_slot_byte(bloom *bf, uint64_t slot);
+
+static void bloom_count_fill(bloom *bf, uint64_t *fill);
+
+static inline unsigned __int128 fastmod_compute_m(uint64_t d);
+
+static inline uint64_t fastmod_u64(uint64_t a, unsigned __int128 m, uint64_t d);
+
+// Primes in [lo, hi). Only the window is sieved, one bit per number, by the primes up to sqrt(hi), so the
+// cost depends on the width of the window and not on how large its numbers are.
+static inline int generate_primes_range(prime_table *primes, uint64_t lo, uint64_t hi) {
+    if (lo < 2) {
+        lo = 2;
+    }
+    if (!primes || hi <= lo) {
         return -1;
     }
 
-    // This calculation guarantees an upper bound approximation, the actual number of primes will never be larger
-    uint64_t approx_count = (uint64_t) ceil((max / log(max) * (1 + (1.2762 / log(max)))));
-    uint64_t max_prime = (uint64_t) max;
-    uint64_t *a = calloc(max_prime, sizeof *a);
-    if (!a) {
+    uint64_t sqrt_hi = (uint64_t) sqrt((double) hi) + 1;
+    uint64_t width = hi - lo;
+    uint8_t *small = calloc(sqrt_hi / 8 + 1, 1);
+    uint8_t *window = calloc(width / 8 + 1, 1);
+    if (!small || !window) {
+        free(small);
+        free(window);
         return -1;
     }
 
-    uint64_t sqrt_max = (uint64_t) sqrt(max);
-    for (uint64_t i = 2; i <= sqrt_max; i++) {
-        if (!a[i]) {
-            for (uint64_t j = (i * i); j < max_prime; j += i) {
-                a[j] = 1;
-            }
+    for (uint64_t i = 2; i * i < hi; i++) {
+        if (small[i / 8] & 1 << i % 8) {
+            continue;
+        }
+        for (uint64_t j = i * i; j <= sqrt_hi; j += i) {
+            small[j / 8] |= 1 << j % 8;
+        }
+        uint64_t first = i * i >= lo ? i * i : (lo + i - 1) / i * i;
+        for (uint64_t j = first - lo; j < width; j += i) {
+            window[j / 8] |= 1 << j % 8;
         }
     }
+    free(small);
 
-    uint64_t *prime_table = calloc(approx_count, sizeof(uint64_t));
-    if (!prime_table) {
-        free(a);
+    uint64_t num_primes = 0;
+    for (uint64_t j = 0; j < width; j++) {
+        num_primes += !(window[j / 8] & 1 << j % 8);
+    }
+    primes->primes = malloc((num_primes ? num_primes : 1) * sizeof *primes->primes);
+    if (!primes->primes) {
+        free(window);
         return -1;
     }
-
-    uint64_t num_primes = 0;
-    for (uint64_t i = 2; i < max_prime; i++) {
-        if (!a[i]) {
-            prime_table[num_primes++] = i;
+    primes->count = 0;
+    for (uint64_t j = 0; j < width; j++) {
+        if (!(window[j / 8] & 1 << j % 8)) {
+            primes->primes[primes->count++] = lo + j;
         }
     }
-    free(a);
+    free(window);
+    return 0;
+}
 
-    primes->primes = realloc(prime_table, num_primes * sizeof *primes->primes);
-    if (!primes->primes) {
-        free(prime_table);
+static inline int generate_primes(prime_table *primes, double max) {
+    if (max < 2) {
         return -1;
     }
+    return generate_primes_range(primes, 2, (uint64_t) max);
+}
 
-    primes->count = num_primes;
-    return 0;
+// Picks the k consecutive primes around the average partition size whose sum is nearest the target. Only a
+// window of primes around the average is generated, and it is widened whenever the search reaches its edge.
+static inline int bloom_calc_partitions(bloom *bf, uint64_t target_size, uint64_t k) {
+    uint64_t avg_part_size = target_size / k;
+    uint64_t width = 300 + (uint64_t) (2 * k * log((double) avg_part_size + 2));
+    while (1) {
+        uint64_t lo = avg_part_size > width + 2 ? avg_part_size - width : 2;
+        prime_table primes;
+        if (generate_primes_range(&primes, lo, avg_part_size + width)) {
+            return -1;
+        }
+        int res = bloom_search_partitions(bf, target_size, k, &primes, lo == 2);
+        free(primes.primes);
+        if (res <= 0) {
+            return res;
+        }
+        width *= 2;
+    }
 }
 
-static inline int bloom_calc_partitions(bloom *bf, long target_size, long k, prime_table *primes) {
-    uint64_t avg_part_size = (uint64_t) ceil(target_size / k);
+// Returns 1 if the primes do not reach far enough on either side of the average. Sums and distances are
+// kept in unsigned 64 bit arithmetic, so sizes beyond 2^53 bits are neither rounded nor overflowed.
+static inline int bloom_search_partitions(bloom *bf, uint64_t target_size, uint64_t k, prime_table *primes,
+                                          bool from_two) {
+    uint64_t avg_part_size = target_size / k;
     long avg_index = binary_search_nearest(primes->primes, primes->count, avg_part_size);
-    long sum = 0;
-    long start_index = avg_index - k + 1 >= 0 ? avg_index - k + 1 : 0;
+    if (primes->count < 2 || (!from_two && avg_index + 1 < (long) k)) {
+        return 1;
+    }
+    uint64_t sum = 0;
+    long start_index = avg_index + 1 >= (long) k ? avg_index + 1 - (long) k : 0;
     for (long i = start_index; i <= avg_index; i++) {
         sum += primes->primes[i];
     }
 
-    long min = labs(sum - target_size);
+    uint64_t min = unsigned_abs(sum, target_size);
     long lowest_index = start_index;
 
     long j = avg_index + 1;
-    long delta = 0;
+    uint64_t delta = 0;
     while (1) {
+        if (j >= (long) primes->count) {
+            return 1;
+        }
         sum += primes->primes[j] - primes->primes[lowest_index];
-        delta = labs(sum - target_size);
+        delta = unsigned_abs(sum, target_size);
         if (delta >= min) {
             break;
         }
@@ -84,39 +179,250 @@ static inline int bloom_calc_partitions(bloom *bf, long target_size, long k, pri
         lowest_index++;
     }
 
-    uint64_t *part_lengths_bytes = calloc(k, sizeof *part_lengths_bytes);
-    if (!part_lengths_bytes) {
-        return -1;
+    // With fewer than k primes below the average the run is chosen short, so k primes above its start are needed
+    if (lowest_index + (long) k > (long) primes->count) {
+        return 1;
     }
-
     for (uint64_t i = 0; i < k; i++) {
         bf->partition_lengths[i] = primes->primes[lowest_index + i];
-        part_lengths_bytes[i] = (uint64_t) ceil((double) bf->partition_lengths[i] / 8);
-        bf->size += part_lengths_bytes[i];
+    }
+    return bloom_layout_partitions(bf);
+}
+
+// Derives the offsets, fastmod constants and array size from the partition lengths. Classic partitions
+// each start on a byte, or on a word or line with BLOOM_ALIGN_WORDS/BLOOM_ALIGN_LINES, blocked partitions
+// are packed into every block. Offsets count slots, which are bits, or counters of BLOOM_COUNTER_BITS in a
+// counting filter. Concurrent filters are padded to whole 64 bit words.
+static inline int bloom_layout_partitions(bloom *bf) {
+    uint64_t slot_bits = bf->flags & BLOOM_COUNTING ? BLOOM_COUNTER_BITS : 1;
+    uint64_t slots_per_byte = 8 / slot_bits;
+    uint64_t align_bits = bf->flags & BLOOM_ALIGN_LINES ? BLOOM_BLOCK_BITS : bf->flags & BLOOM_ALIGN_WORDS ? 64 : 8;
+    uint64_t align_slots = align_bits / slot_bits;
+    uint64_t offset_sum = 0;
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        bf->partition_fastmod[i] = fastmod_compute_m(bf->partition_lengths[i]);
+        bf->partition_offsets[i] = offset_sum;
+        if (bf->flags & BLOOM_BLOCKED) {
+            offset_sum += bf->partition_lengths[i];
+        } else {
+            offset_sum += (bf->partition_lengths[i] + align_slots - 1) / align_slots * align_slots;
+        }
+    }
+
+    bf->size = bf->flags & BLOOM_BLOCKED ? bf->num_blocks * BLOOM_BLOCK_BYTES : offset_sum / slots_per_byte;
+    if (bf->flags & BLOOM_CONCURRENT) {
+        bf->size = (bf->size + 7) / 8 * 8;
+    }
+    return 0;
+}
+
+static inline int bloom_alloc_partitions(bloom *bf, uint64_t k) {
+    bf->partition_ptrs = calloc(k, sizeof *bf->partition_ptrs);
+    bf->partition_lengths = calloc(k, sizeof(uint64_t));
+    bf->partition_fastmod = calloc(k, sizeof *bf->partition_fastmod);
+    bf->partition_offsets = calloc(k, sizeof *bf->partition_offsets);
+    if (!bf->partition_ptrs || !bf->partition_lengths || !bf->partition_fastmod || !bf->partition_offsets) {
+        return -1;
+    }
+    bf->num_partitions = k;
+    return 0;
+}
+
+// Maps a zeroed array, for BLOOM_HUGE_PAGES or NUMA replicas. Huge page arrays come from reserved huge pages,
+// 1GB ones only for arrays of at least 1GB, or else from ordinary pages aligned to 2MB so that transparent huge
+// pages can back all of them. With a node, mbind has the pages allocated on it whichever thread touches them
+// first. Returns 1 when the array was mapped but mbind failed, leaving the pages wherever they are first touched.
+static inline int bloom_map_array(bloom *bf, int64_t node) {
+    static const struct {
+        int shift;
+        uint32_t pages;
+    } sizes[] = {{30, BLOOM_PAGES_1G}, {21, BLOOM_PAGES_2M}};
+    uint8_t *map = MAP_FAILED;
+    for (uint64_t i = 0; i < sizeof sizes / sizeof *sizes && bf->flags & BLOOM_HUGE_PAGES; i++) {
+        uint64_t page = 1ULL << sizes[i].shift;
+        if (bf->total_size < page && sizes[i].pages == BLOOM_PAGES_1G) {
+            continue;
+        }
+        uint64_t map_len = (bf->total_size + page - 1) & ~(page - 1);
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizes[i].shift << MAP_HUGE_SHIFT, -1, 0);
+        if (map != MAP_FAILED) {
+            bf->map_len = map_len;
+            bf->pages = sizes[i].pages;
+            break;
+        }
+    }
+
+    if (map == MAP_FAILED) {
+        uint64_t page = bf->flags & BLOOM_HUGE_PAGES ? 1ULL << 21 : (uint64_t) sysconf(_SC_PAGESIZE);
+        uint64_t map_len = (bf->total_size + page - 1) & ~(page - 1);
+        map = mmap(NULL, map_len + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        uint8_t *aligned = (uint8_t *) (((uintptr_t) map + page - 1) & ~(page - 1));
+        if (aligned > map) {
+            munmap(map, aligned - map);
+        }
+        munmap(aligned + map_len, map + map_len + page - (aligned + map_len));
+        map = aligned;
+        bf->map_len = map_len;
+        if (bf->flags & BLOOM_HUGE_PAGES && !madvise(map, map_len, MADV_HUGEPAGE)) {
+            bf->pages = BLOOM_PAGES_THP;
+        }
+    }
+
+    bf->base_ptr = map;
+    bf->alloced = true;
+
+    unsigned long mask[16] = {0};
+    if (node < 0) {
+        return 0;
+    }
+    if ((uint64_t) node >= sizeof mask * 8) {
+        return 1;
+    }
+    mask[node / (sizeof *mask * 8)] = 1UL << node % (sizeof *mask * 8);
+    return syscall(SYS_mbind, map, bf->map_len, MPOL_PREFERRED, mask, sizeof mask * 8, 0) ? 1 : 0;
+}
+
+// Allocates the prefix and bit array unless an existing array was passed in, and points the partitions
+// into it. Blocked and cache aligned filters start on a cache line and are padded to whole lines, so every
+// block occupies a single line (provided prefix_len is a multiple of it) and no other allocation shares the
+// filter's lines. Concurrent and aligned filters need their 64 bit words aligned for the word probes.
+static inline int bloom_alloc_array(bloom *bf) {
+    if (bf->flags & BLOOM_CONCURRENT) {
+        bf->elem_stripes = aligned_alloc(BLOOM_BLOCK_BYTES, BLOOM_COUNTER_STRIPES * BLOOM_STRIPE_WORDS * sizeof(uint64_t));
+        if (!bf->elem_stripes) {
+            return -1;
+        }
+        memset(bf->elem_stripes, 0, BLOOM_COUNTER_STRIPES * BLOOM_STRIPE_WORDS * sizeof(uint64_t));
     }
 
     bf->total_size = bf->size + bf->prefix_len;
     if (!bf->base_ptr) {
-        bf->base_ptr = calloc(1, bf->total_size);
+        if (bf->flags & BLOOM_HUGE_PAGES) {
+            if (bloom_map_array(bf, -1)) {
+                return -1;
+            }
+        } else if (bf->flags & (BLOOM_BLOCKED | BLOOM_CONCURRENT | BLOOM_CACHE_ALIGNED | BLOOM_ALIGNED)) {
+            uint64_t alloc_size = (bf->total_size + BLOOM_BLOCK_BYTES - 1) / BLOOM_BLOCK_BYTES * BLOOM_BLOCK_BYTES;
+            bf->base_ptr = aligned_alloc(BLOOM_BLOCK_BYTES, alloc_size);
+            if (bf->base_ptr) {
+                memset(bf->base_ptr, 0, alloc_size);
+            }
+        } else {
+            bf->base_ptr = calloc(1, bf->total_size);
+        }
         if (!bf->base_ptr) {
-            free(part_lengths_bytes);
             return -1;
         }
-        bf->bloom_ptr = bf->base_ptr + bf->prefix_len;
         bf->alloced = true;
     }
 
-    uint64_t offset_sum = 0;
-    bf->partition_ptrs[0] = bf->bloom_ptr;
-    for (uint64_t i = 1; i < k; i++) {
-        offset_sum += part_lengths_bytes[i - 1];
-        bf->partition_ptrs[i] = bf->bloom_ptr + offset_sum;
+    bf->bloom_ptr = bf->base_ptr + bf->prefix_len;
+    if (bf->flags & (BLOOM_CONCURRENT | BLOOM_ALIGNED) && (uintptr_t) bf->bloom_ptr % 8) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        uint64_t byte = bloom_slot_byte(bf, bf->partition_offsets[i]);
+        bf->partition_ptrs[i] = bf->flags & BLOOM_BLOCKED ? NULL : bf->bloom_ptr + byte;
     }
 
-    free(part_lengths_bytes);
+    if (bf->flags & BLOOM_TRACK_FILL) {
+        bf->partition_fill = calloc(bf->num_partitions, sizeof *bf->partition_fill);
+        if (!bf->partition_fill) {
+            return -1;
+        }
+        // Counting an attached array would read all of it, faulting in every page of a mapped file
+        bf->fill_pending = !bf->alloced;
+    }
     return 0;
 }
 
+// Expected false positive rate of a blocked filter. The number of keys landing in a block is Poisson
+// distributed, and the overloaded blocks dominate the rate, which is why a blocked filter needs more
+// space than the classic layout for the same p.
+static inline double bloom_blocked_fpr(double n, uint64_t num_blocks, const uint64_t *lengths, uint64_t k) {
+    double lambda = n / num_blocks;
+    double spread = 10 * sqrt(lambda) + 10;
+    uint64_t lo = lambda > spread ? (uint64_t) (lambda - spread) : 0;
+    uint64_t hi = (uint64_t) (lambda + spread);
+    double fpr = 0.0;
+    for (uint64_t x = lo; x <= hi; x++) {
+        double fill = 1.0;
+        for (uint64_t i = 0; i < k; i++) {
+            fill *= 1.0 - pow(1.0 - 1.0 / lengths[i], (double) x);
+        }
+        fpr += exp(x * log(lambda) - lambda - lgamma(x + 1.0)) * fill;
+    }
+    return fpr;
+}
+
+// Picks the number of partitions and blocks giving the smallest blocked filter that meets p. For each k,
+// the partitions are the k consecutive primes with the largest sum that still fits in one block.
+static inline int bloom_calc_blocks(double n, double p, prime_table *primes, uint64_t *k, uint64_t *first_prime,
+                                    uint64_t *num_blocks) {
+    static double ln1_div_2topowof_ln2 = -0.48045301391820149916611626395024359226226806640625;
+    uint64_t base_blocks = (uint64_t) ceil(ceil((n * log(p)) / ln1_div_2topowof_ln2) / BLOOM_BLOCK_BITS);
+    uint64_t max_k = primes->count < BLOOM_BLOCK_MAX_PARTITIONS ? primes->count : BLOOM_BLOCK_MAX_PARTITIONS;
+    *num_blocks = 0;
+
+    for (uint64_t parts = 1; parts <= max_k; parts++) {
+        uint64_t first = 0;
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < parts; i++) {
+            sum += primes->primes[i];
+        }
+        if (sum > BLOOM_BLOCK_BITS) {
+            break;
+        }
+        while (first + parts < primes->count
+               && sum + primes->primes[first + parts] - primes->primes[first] <= BLOOM_BLOCK_BITS) {
+            sum += primes->primes[first + parts] - primes->primes[first];
+            first++;
+        }
+
+        uint64_t hi = base_blocks ? base_blocks : 1;
+        while (bloom_blocked_fpr(n, hi, primes->primes + first, parts) > p) {
+            hi *= 2;
+            if (hi > base_blocks * BLOOM_BLOCK_MAX_GROWTH) {
+                hi = 0;
+                break;
+            }
+        }
+        if (!hi) {
+            continue;
+        }
+
+        uint64_t lo = hi / 2;
+        while (hi - lo > 1) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (bloom_blocked_fpr(n, mid, primes->primes + first, parts) > p) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (!*num_blocks || hi < *num_blocks) {
+            *num_blocks = hi;
+            *k = parts;
+            *first_prime = first;
+        }
+    }
+
+    return *num_blocks ? 0 : -1;
+}
+
+static inline int bloom_layout_blocks(bloom *bf, prime_table *primes, uint64_t first_prime, uint64_t num_blocks) {
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        bf->partition_lengths[i] = primes->primes[first_prime + i];
+    }
+    bf->num_blocks = num_blocks;
+    return bloom_layout_partitions(bf);
+}
+
 static inline uint64_t unsigned_abs(uint64_t a, uint64_t b) {
     uint64_t diff = a - b;
     if (b > a) {
@@ -130,7 +436,7 @@ static inline long binary_search_nearest(const uint64_t *elem_array, size_t num_
         return -1;
     }
     if (num_elems == 1) {
-        return elem_array[0];
+        return 0;
     }
 
     long low = 0;
@@ -147,13 +453,17 @@ static inline long binary_search_nearest(const uint64_t *elem_array, size_t num_
             break;
     }
 
+    // The neighbours are clamped to the array, for values beyond either end of it
+    mid = mid < (long) num_elems ? mid : (long) num_elems - 1;
+    long below = mid > 0 ? mid - 1 : mid;
+    long above = mid + 1 < (long) num_elems ? mid + 1 : mid;
     long index;
     if (elem_array[mid] == value) {
         index = mid;
     } else {
-        uint64_t diff1 = unsigned_abs(elem_array[mid - 1], value);
-        uint64_t diff2 = unsigned_abs(elem_array[mid + 1], value);
-        index = diff1 > diff2 ? mid + 1 : mid - 1;
+        uint64_t diff1 = unsigned_abs(elem_array[below], value);
+        uint64_t diff2 = unsigned_abs(elem_array[above], value);
+        index = diff1 > diff2 ? above : below;
     }
 
     return index;
@@ -164,134 +474,2598 @@ uint64_t bloom_remaining_capacity(bloom *bf) {
         return 0;
     }
 
-    return bf->capacity > bf->num_elems ? bf->capacity - bf->num_elems : 0;
+    uint64_t num_elems = bf->partition_fill ? bloom_estimate_count(bf) : bloom_get_num_elems(bf);
+    return bf->capacity > num_elems ? bf->capacity - num_elems : 0;
 }
 
-int bloom_add(bloom *bf, uint8_t *data, uint64_t data_len) {
-    if (!bf || !data || !data_len) {
-        return -1;
+// Lemire's fastmod (https://arxiv.org/abs/1902.01961), exact for any 64 bit numerator and divisor > 1,
+// so positions are bit-identical to hash % partition_lengths[i] without a hardware divide.
+static inline unsigned __int128 fastmod_compute_m(uint64_t d) {
+    return ~(unsigned __int128) 0 / d + 1;
+}
+
+static inline uint64_t fastmod_u64(uint64_t a, unsigned __int128 m, uint64_t d) {
+    unsigned __int128 low_bits = m * a;
+    unsigned __int128 bottom_half = (low_bits & UINT64_MAX) * d;
+    unsigned __int128 top_half = (low_bits >> 64) * d;
+    return (uint64_t) ((top_half + (bottom_half >> 64)) >> 64);
+}
+
+// Large filters step partition i by i times the (odd) high half of the hash, so the positions of a key in two
+// partitions are independent rather than the same 64 bit value reduced by two moduli
+static inline uint64_t bloom_partition_bit(bloom *bf, bloom_wide_hash hash, uint64_t i) {
+    uint64_t material = (uint64_t) hash;
+    if (bf->flags & BLOOM_LARGE) {
+        material += i * ((uint64_t) (hash >> 64) | 1);
     }
+    return fastmod_u64(material, bf->partition_fastmod[i], bf->partition_lengths[i]);
+}
 
-    uint64_t hash = XXH64(data, data_len, 0);
-    for (uint64_t i = 0; i < bf->num_partitions; i++) {
-        uint64_t partition_bit = hash % bf->partition_lengths[i];
-        bf->partition_ptrs[i][partition_bit / 8] |= 1 << (partition_bit % 8);
+// Bit offset of the block a hash maps to. In the classic layout the whole filter is one block; in the
+// blocked layout the high bits of the hash select a block and only the low 32 bits index the partitions.
+static inline uint64_t bloom_block_offset(bloom *bf, uint64_t hash) {
+    if (!(bf->flags & BLOOM_BLOCKED)) {
+        return 0;
     }
+    return (uint64_t) (((unsigned __int128) hash * bf->num_blocks) >> 64) * BLOOM_BLOCK_BITS;
+}
 
-    bf->num_elems++;
-    return 0;
+static inline bloom_wide_hash bloom_partition_hash(bloom *bf, bloom_wide_hash hash) {
+    return bf->flags & BLOOM_BLOCKED ? (uint32_t) hash : hash;
 }
 
-int bloom_test(bloom *bf, uint8_t *data, uint64_t data_len) {
-    if (!bf || !data || !data_len) {
-        return -1;
+static inline uint64_t bloom_bit_index(bloom *bf, uint64_t block, bloom_wide_hash hash, uint64_t i) {
+    return block + bf->partition_offsets[i] + bloom_partition_bit(bf, hash, i);
+}
+
+// Counting filters pack BLOOM_COUNTER_BITS wide counters into bytes, low bits first. Counters saturate at
+// their maximum and are never decremented from it, since the true count is lost.
+#define BLOOM_COUNTER_MAX ((1U << BLOOM_COUNTER_BITS) - 1)
+
+static inline uint64_t bloom_slot_byte(bloom *bf, uint64_t slot) {
+    return bf->flags & BLOOM_COUNTING ? slot * BLOOM_COUNTER_BITS / 8 : slot / 8;
+}
+
+static inline uint32_t bloom_get_counter(bloom *bf, uint64_t slot) {
+    if (bf->flags & BLOOM_WORD_PROBES) {
+        uint32_t shift = slot * BLOOM_COUNTER_BITS % 64;
+        return ((uint64_t *) bf->bloom_ptr)[slot * BLOOM_COUNTER_BITS / 64] >> shift & BLOOM_COUNTER_MAX;
+    }
+    uint32_t shift = slot * BLOOM_COUNTER_BITS % 8;
+    return bf->bloom_ptr[slot * BLOOM_COUNTER_BITS / 8] >> shift & BLOOM_COUNTER_MAX;
+}
+
+// Both return whether the counter moved between zero and non-zero
+static inline int bloom_inc_counter(bloom *bf, uint64_t slot) {
+    if (bf->flags & BLOOM_WORD_PROBES) {
+        uint32_t shift = slot * BLOOM_COUNTER_BITS % 64;
+        uint64_t *word = (uint64_t *) bf->bloom_ptr + slot * BLOOM_COUNTER_BITS / 64;
+        uint32_t count = *word >> shift & BLOOM_COUNTER_MAX;
+        if (count != BLOOM_COUNTER_MAX) {
+            *word += 1ULL << shift;
+        }
+        return !count;
+    }
+    uint32_t shift = slot * BLOOM_COUNTER_BITS % 8;
+    uint8_t *byte = bf->bloom_ptr + slot * BLOOM_COUNTER_BITS / 8;
+    uint32_t count = *byte >> shift & BLOOM_COUNTER_MAX;
+    if (count != BLOOM_COUNTER_MAX) {
+        *byte += 1 << shift;
+    }
+    return !count;
+}
+
+static inline int bloom_dec_counter(bloom *bf, uint64_t slot) {
+    if (bf->flags & BLOOM_WORD_PROBES) {
+        uint32_t shift = slot * BLOOM_COUNTER_BITS % 64;
+        uint64_t *word = (uint64_t *) bf->bloom_ptr + slot * BLOOM_COUNTER_BITS / 64;
+        uint32_t count = *word >> shift & BLOOM_COUNTER_MAX;
+        if (count && count != BLOOM_COUNTER_MAX) {
+            *word -= 1ULL << shift;
+        }
+        return count == 1;
+    }
+    uint32_t shift = slot * BLOOM_COUNTER_BITS % 8;
+    uint8_t *byte = bf->bloom_ptr + slot * BLOOM_COUNTER_BITS / 8;
+    uint32_t count = *byte >> shift & BLOOM_COUNTER_MAX;
+    if (count && count != BLOOM_COUNTER_MAX) {
+        *byte -= 1 << shift;
+    }
+    return count == 1;
+}
+
+// Concurrent filters set bits with a relaxed atomic OR on the aligned 64 bit word holding them, skipped
+// when the bit is already set so saturated lines are not bounced between writers. Aligned filters use the
+// same word with a plain OR. On little endian machines the word bit is the same bit the byte-wise layout uses.
+// Returns whether the slot was empty before, for filters tracking their fill
+static inline int bloom_set_bit(bloom *bf, uint64_t bit) {
+    if (!(bf->flags & (BLOOM_CONCURRENT | BLOOM_COUNTING | BLOOM_ALIGNED))) {
+        uint8_t old = bf->bloom_ptr[bit / 8];
+        bf->bloom_ptr[bit / 8] = old | 1 << (bit % 8);
+        return !(old & 1 << (bit % 8));
+    }
+    if (bf->flags & BLOOM_COUNTING) {
+        return bloom_inc_counter(bf, bit);
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t *word = (uint64_t *) bf->bloom_ptr + bit / 64;
+    uint64_t mask = 1ULL << (bit % 64);
+#else
+    uint8_t *word = bf->bloom_ptr + bit / 8;
+    uint8_t mask = 1 << (bit % 8);
+#endif
+    if (!(bf->flags & BLOOM_CONCURRENT)) {
+        int fresh = !(*word & mask);
+        *word |= mask;
+        return fresh;
+    }
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) {
+        return 0;
+    }
+    return !(__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask);
+}
+
+// A relaxed load is a plain load on every mainstream target, and keeps tests well defined alongside
+// concurrent adds
+static inline int bloom_get_bit(bloom *bf, uint64_t bit) {
+    if (bf->flags & BLOOM_COUNTING) {
+        return bloom_get_counter(bf, bit);
+    }
+    if (bf->flags & BLOOM_WORD_PROBES) {
+        return __atomic_load_n((uint64_t *) bf->bloom_ptr + bit / 64, __ATOMIC_RELAXED) >> bit % 64 & 1;
+    }
+    return __atomic_load_n(bf->bloom_ptr + bit / 8, __ATOMIC_RELAXED) & 1 << bit % 8;
+}
+
+// Concurrent filters count elements in cache line sized stripes, one per thread (modulo the stripe
+// count), so writers do not contend on a single counter
+static _Thread_local uint32_t bloom_thread_stripe = UINT32_MAX;
+static uint32_t bloom_next_stripe = 0;
+
+// A file opened without BLOOM_MAP_WRITE is mapped read only, and any write to it would fault. Anonymous
+// mappings (huge pages, replicas) are the filter's own array and always writable.
+static inline bool bloom_read_only(bloom *bf) {
+    return bf->map_len && !bf->map_writable && !bf->alloced;
+}
+
+static inline void bloom_count_elems(bloom *bf, uint64_t count) {
+    if (!(bf->flags & BLOOM_CONCURRENT)) {
+        bf->num_elems += count;
+        return;
+    }
+    if (bloom_thread_stripe == UINT32_MAX) {
+        bloom_thread_stripe = __atomic_fetch_add(&bloom_next_stripe, 1, __ATOMIC_RELAXED) % BLOOM_COUNTER_STRIPES;
+    }
+    __atomic_fetch_add(&bf->elem_stripes[bloom_thread_stripe * BLOOM_STRIPE_WORDS], count, __ATOMIC_RELAXED);
+}
+
+uint64_t bloom_get_num_elems(bloom *bf) {
+    if (!bf) {
+        return 0;
     }
+    if (!(bf->flags & BLOOM_CONCURRENT)) {
+        return bf->num_elems;
+    }
+
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < BLOOM_COUNTER_STRIPES; i++) {
+        sum += __atomic_load_n(&bf->elem_stripes[i * BLOOM_STRIPE_WORDS], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+// Filled slots are counted with relaxed atomics, so concurrent filters can track their fill too
+static inline void bloom_track_fill(bloom *bf, uint64_t i, int64_t delta) {
+    if (bf->flags & BLOOM_CONCURRENT) {
+        __atomic_fetch_add(&bf->partition_fill[i], delta, __ATOMIC_RELAXED);
+    } else {
+        bf->partition_fill[i] += delta;
+    }
+}
 
-    uint64_t hash = XXH64(data, data_len, 0);
+// Returns whether any slot was empty before, which is what bloom_check_hash would have returned
+static inline int bloom_set_hash(bloom *bf, bloom_wide_hash hash) {
+    uint64_t block = bloom_block_offset(bf, hash);
+    hash = bloom_partition_hash(bf, hash);
+    int fresh = 0;
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        if (bloom_set_bit(bf, bloom_bit_index(bf, block, hash, i))) {
+            fresh = 1;
+            if (bf->partition_fill) {
+                bloom_track_fill(bf, i, 1);
+            }
+        }
+    }
+    return fresh;
+}
 
+static inline int bloom_check_hash(bloom *bf, bloom_wide_hash hash) {
+    uint64_t block = bloom_block_offset(bf, hash);
+    hash = bloom_partition_hash(bf, hash);
     for (uint64_t i = 0; i < bf->num_partitions; i++) {
-        uint64_t partition_bit = hash % bf->partition_lengths[i];
-        if (!(bf->partition_ptrs[i][partition_bit / 8] & 1 << partition_bit % 8)) {
+        if (!bloom_get_bit(bf, bloom_bit_index(bf, block, hash, i))) {
             return 1;
         }
     }
     return 0;
 }
 
-bloom *bloom_alloc(double p, uint64_t n, uint8_t *bloom_data, uint64_t prefix_len) {
-    bloom *bf = calloc(1, sizeof *bf);
-
-    if (bloom_init(bf, p, n, bloom_data, prefix_len)) {
-        bloom_free(bf);
-        bf = NULL;
+// Adds the key only if some slot is empty, counting it as a new element. Other filters test and set in the
+// one pass of bloom_set_hash, as setting a set bit changes nothing; the counters of a counting filter are
+// left alone for a key already present, so it takes a single bloom_remove to take out again.
+static inline int bloom_test_and_set_hash(bloom *bf, bloom_wide_hash hash) {
+    if (bf->flags & BLOOM_COUNTING && !bloom_check_hash(bf, hash)) {
+        return 0;
+    }
+    int fresh = bloom_set_hash(bf, hash);
+    if (fresh) {
+        bloom_count_elems(bf, 1);
     }
+    return fresh;
+}
 
-    return bf;
+// Prefetches the first line a test of the hash reads: its block in a blocked filter, or its byte in the first
+// partition of a classic one. A key absent from a classic filter usually fails on one of its first probes, so
+// prefetching all k partitions would mostly fetch lines that are never read.
+static inline void bloom_prefetch_hash(bloom *bf, uint64_t hash) {
+    uint64_t block = bloom_block_offset(bf, hash);
+    uint64_t bit = bf->flags & BLOOM_BLOCKED ? block : bloom_bit_index(bf, 0, hash, 0);
+    __builtin_prefetch(bf->bloom_ptr + bloom_slot_byte(bf, bit), 0);
 }
 
-int bloom_init(bloom *bf, double p, uint64_t n, uint8_t *bloom_data, uint64_t prefix_len) {
-    if (!bf || p <= 0.0 || n <= 0) {
-        return -1;
-    }
-    // ln (1 / (2^(ln 2))
-    static double ln1_div_2topowof_ln2 = -0.48045301391820149916611626395024359226226806640625;
-    double target_size = ceil((n * log(p)) / ln1_div_2topowof_ln2);
-    uint64_t num_partitions = (uint64_t) ceil(log(2.0) * target_size / n);
-    bf->partition_ptrs = calloc(num_partitions, sizeof *bf->partition_ptrs);
-    bf->partition_lengths = calloc(num_partitions, sizeof(uint64_t));
-    if (!bf->partition_ptrs || !bf->partition_lengths) {
-        return -1;
+// Blocked filters need a single prefetch per key, as all of its bits share one cache line
+static inline void bloom_prefetch_bits(bloom *bf, const uint64_t *bits, uint64_t count, int rw) {
+    uint64_t stride = bf->flags & BLOOM_BLOCKED ? bf->num_partitions : 1;
+    for (uint64_t i = 0; i < count * bf->num_partitions; i += stride) {
+        if (rw) {
+            __builtin_prefetch(bf->bloom_ptr + bloom_slot_byte(bf, bits[i]), 1);
+        } else {
+            __builtin_prefetch(bf->bloom_ptr + bloom_slot_byte(bf, bits[i]), 0);
+        }
     }
+}
 
-    bf->prefix_len = prefix_len;
-    bf->num_partitions = num_partitions;
-    bf->false_pos_rate = p;
+// Batch kernels. An index kernel computes the bit index of every (key, partition) pair of a group of up
+// to BLOOM_BATCH_SIZE hashes into bits, key j owning bits[j * k .. j * k + k - 1]. A probe kernel then
+// tests those bits, writing the bloom_test result of each key into results. The vector kernels treat the
+// pairs as one stream of lanes, so several keys share a vector when num_partitions is below the vector
+// width. They need partition lengths below 2^31 and are only used when bloom_init_ex set up the lane
+// tables; the bits buffer must have room for 8 entries past the end of the group.
+typedef void (*bloom_index_fn)(bloom *bf, const uint64_t *hashes, uint64_t count, uint64_t *bits);
 
-    bf->capacity = n;
-    bf->num_elems = 0;
+typedef void (*bloom_probe_fn)(bloom *bf, const uint64_t *bits, uint64_t count, uint8_t *results);
+
+// Merge kernels combine two bit arrays word by word into dst (which may alias either input) and count the
+// set bits of the result, a and b into pop[0], pop[1] and pop[2] in the same pass
+#define BLOOM_MERGE_OR 0
+#define BLOOM_MERGE_AND 1
+
+// Population counts are compiled for both the popcnt instruction and the generic fallback, picked at load time
+#if defined(__x86_64__)
+#define BLOOM_POPCNT_CLONES __attribute__((target_clones("popcnt", "default")))
+#else
+#define BLOOM_POPCNT_CLONES
+#endif
 
-    if (bloom_data) {
-        bf->base_ptr = bloom_data;
-        bf->bloom_ptr = bf->base_ptr + bf->prefix_len;
-        bf->alloced = false;
+typedef void (*bloom_merge_fn)(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint64_t len, int op,
+                               uint64_t *pop);
+
+// Row r describes the 8 lanes of a vector whose first lane is partition r: the partition parameters for
+// each lane and how many keys past the vector's first key the lane belongs to.
+typedef struct bloom_lanes {
+  uint64_t *lengths;
+  double *inverse;
+  uint64_t *offsets;
+  uint64_t *keys;
+} bloom_lanes;
+
+static void bloom_index_scalar(bloom *bf, const uint64_t *hashes, uint64_t count, uint64_t *bits) {
+    for (uint64_t j = 0; j < count; j++) {
+        uint64_t block = bloom_block_offset(bf, hashes[j]);
+        uint64_t hash = bloom_partition_hash(bf, hashes[j]);
+        for (uint64_t i = 0; i < bf->num_partitions; i++) {
+            *bits++ = bloom_bit_index(bf, block, hash, i);
+        }
     }
+}
 
-    prime_table primes;
-    if (generate_primes(&primes, (target_size / num_partitions) + 300)) {
-        return -1;
+static void bloom_merge_tail(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint64_t start, uint64_t len,
+                             int op, uint64_t *pop) {
+    for (uint64_t i = start; i < len; i++) {
+        uint8_t res = op == BLOOM_MERGE_OR ? a[i] | b[i] : a[i] & b[i];
+        pop[0] += __builtin_popcount(res);
+        pop[1] += __builtin_popcount(a[i]);
+        pop[2] += __builtin_popcount(b[i]);
+        dst[i] = res;
     }
+}
 
-    int res = bloom_calc_partitions(bf, (long) target_size, num_partitions, &primes);
-    free(primes.primes);
-    return res;
+BLOOM_POPCNT_CLONES
+static void bloom_merge_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint64_t len, int op,
+                               uint64_t *pop) {
+    uint64_t words = len / 8;
+    for (uint64_t i = 0; i < words; i++) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i * 8, 8);
+        memcpy(&wb, b + i * 8, 8);
+        uint64_t res = op == BLOOM_MERGE_OR ? wa | wb : wa & wb;
+        pop[0] += __builtin_popcountll(res);
+        pop[1] += __builtin_popcountll(wa);
+        pop[2] += __builtin_popcountll(wb);
+        memcpy(dst + i * 8, &res, 8);
+    }
+    bloom_merge_tail(dst, a, b, words * 8, len, op, pop);
 }
 
-void bloom_print(bloom *bf) {
-    printf("Bloomfilter stats\n--------\n");
-    printf("Size: %ld bytes (% ld bits)\n", bf->size, bf->size * 8);
-    printf("Capacity: %ld (%ld used)\n", bf->capacity, bf->num_elems);
-    printf("Number of partitions: %ld\n", bf->num_partitions);
-    printf("Target false positive rate: %.10f\n", bf->false_pos_rate);
-    printf("Partition sizes (bits): ");
-    for (int i = 0; i < bf->num_partitions - 1; i++) {
-        printf("%ld, ", bf->partition_lengths[i]);
+static void bloom_probe_scalar(bloom *bf, const uint64_t *bits, uint64_t count, uint8_t *results) {
+    for (uint64_t j = 0; j < count; j++) {
+        uint8_t res = 0;
+        for (uint64_t i = 0; i < bf->num_partitions; i++) {
+            if (!bloom_get_bit(bf, bits[i])) {
+                res = 1;
+                break;
+            }
+        }
+        results[j] = res;
+        bits += bf->num_partitions;
     }
-    printf("%ld\n", bf->partition_lengths[bf->num_partitions - 1]);
 }
 
-void bloom_clear(bloom *bf) {
-    if (!bf)
-        return;
+#if defined(__x86_64__)
+#include <immintrin.h>
 
-    free(bf->partition_ptrs);
-    free(bf->partition_lengths);
+// u32 lanes to double via the 2^52 exponent trick, avoiding the AVX-512DQ conversions
+#define BLOOM_MAGIC_52 0x4330000000000000ULL
 
-    if (bf->alloced) {
-        free(bf->base_ptr);
+static inline void bloom_lanes_prepare(bloom *bf, const uint64_t *hashes, uint64_t count, uint64_t *part_hashes,
+                                       uint64_t *blocks) {
+    for (uint64_t j = 0; j < count; j++) {
+        blocks[j] = bloom_block_offset(bf, hashes[j]);
+        part_hashes[j] = bloom_partition_hash(bf, hashes[j]);
     }
+}
 
-    bf->base_ptr = NULL;
-    bf->bloom_ptr = NULL;
-    bf->size = 0;
-    bf->total_size = 0;
-    bf->num_partitions = 0;
-    bf->prefix_len = 0;
-    bf->false_pos_rate = 0.0;
-    bf->partition_ptrs = NULL;
-    bf->partition_lengths = NULL;
-    bf->capacity = 0;
-    bf->num_elems = 0;
+static inline void bloom_lanes_advance(uint64_t *r, uint64_t *key, uint64_t width, uint64_t k) {
+    *r += width;
+    while (*r >= k) {
+        *r -= k;
+        (*key)++;
+    }
 }
 
-void bloom_free(bloom *bf) {
-    bloom_clear(bf);
-    free(bf);
+__attribute__((target("avx2")))
+static inline __m256d bloom_u32_to_pd_avx2(__m256i x) {
+    __m256i magic = _mm256_set1_epi64x(BLOOM_MAGIC_52);
+    return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, magic)), _mm256_castsi256_pd(magic));
 }
 
-uint8_t *bloom_get_filter(bloom *bf) {
-    return bf->bloom_ptr;
+__attribute__((target("avx2")))
+static inline __m256i bloom_floor_u52_avx2(__m256d x) {
+    __m256d magic = _mm256_castsi256_pd(_mm256_set1_epi64x(BLOOM_MAGIC_52));
+    __m256i bits = _mm256_castpd_si256(_mm256_add_pd(_mm256_floor_pd(x), magic));
+    return _mm256_and_si256(bits, _mm256_set1_epi64x((1ULL << 52) - 1));
 }
-uint8_t *bloom_get_prefix(bloom *bf) {
-    return bf->base_ptr;
+
+// x is in (-p, 2p), bring it into [0, p)
+__attribute__((target("avx2")))
+static inline __m256i bloom_correct_avx2(__m256i x, __m256i p) {
+    __m256i zero = _mm256_setzero_si256();
+    x = _mm256_add_epi64(x, _mm256_and_si256(_mm256_cmpgt_epi64(zero, x), p));
+    __m256i ge = _mm256_cmpgt_epi64(x, _mm256_sub_epi64(p, _mm256_set1_epi64x(1)));
+    return _mm256_sub_epi64(x, _mm256_and_si256(ge, p));
 }
 
+__attribute__((target("avx2")))
+static void bloom_index_avx2(bloom *bf, const uint64_t *hashes, uint64_t count, uint64_t *bits) {
+    uint64_t part_hashes[BLOOM_BATCH_SIZE + 8] = {0};
+    uint64_t blocks[BLOOM_BATCH_SIZE + 8] = {0};
+    bloom_lanes_prepare(bf, hashes, count, part_hashes, blocks);
+
+    const __m256i low32 = _mm256_set1_epi64x(0xffffffff);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256d two32 = _mm256_set1_pd(4294967296.0);
+    const __m256d max_q = _mm256_set1_pd(4294967295.0);
+    bloom_lanes *lanes = bf->lanes;
+    uint64_t k = bf->num_partitions;
+    uint64_t total = count * k;
+    uint64_t key = 0;
+    uint64_t r = 0;
+
+    for (uint64_t lane = 0; lane < total; lane += 4) {
+        __m256i p = _mm256_loadu_si256((const __m256i *) (lanes->lengths + r * 8));
+        __m256d inv = _mm256_loadu_pd(lanes->inverse + r * 8);
+        __m256i off = _mm256_loadu_si256((const __m256i *) (lanes->offsets + r * 8));
+        __m256i key_pair = _mm256_slli_epi64(_mm256_loadu_si256((const __m256i *) (lanes->keys + r * 8)), 1);
+        __m256i key_idx = _mm256_or_si256(key_pair, _mm256_slli_epi64(_mm256_add_epi64(key_pair, one), 32));
+        __m256i h = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *) (part_hashes + key)), key_idx);
+        __m256i base = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *) (blocks + key)), key_idx);
+
+        // hash % p == ((hash_hi % p) * 2^32 + hash_lo) % p, each step a double precision quotient
+        // estimate that is at most one off, followed by a correction
+        __m256i h_hi = _mm256_srli_epi64(h, 32);
+        __m256i q = bloom_floor_u52_avx2(_mm256_mul_pd(bloom_u32_to_pd_avx2(h_hi), inv));
+        __m256i rem = bloom_correct_avx2(_mm256_sub_epi64(h_hi, _mm256_mul_epu32(q, p)), p);
+
+        __m256i t = _mm256_add_epi64(_mm256_slli_epi64(rem, 32), _mm256_and_si256(h, low32));
+        __m256d t_d = _mm256_add_pd(_mm256_mul_pd(bloom_u32_to_pd_avx2(_mm256_srli_epi64(t, 32)), two32),
+                                    bloom_u32_to_pd_avx2(_mm256_and_si256(t, low32)));
+        q = bloom_floor_u52_avx2(_mm256_min_pd(_mm256_mul_pd(t_d, inv), max_q));
+        rem = bloom_correct_avx2(_mm256_sub_epi64(t, _mm256_mul_epu32(q, p)), p);
+
+        _mm256_storeu_si256((__m256i *) (bits + lane), _mm256_add_epi64(_mm256_add_epi64(base, off), rem));
+        bloom_lanes_advance(&r, &key, 4, k);
+    }
+}
+
+__attribute__((target("avx2")))
+static void bloom_probe_avx2(bloom *bf, const uint64_t *bits, uint64_t count, uint8_t *results) {
+    uint8_t absent_keys[BLOOM_BATCH_SIZE + 8] = {0};
+    const __m256i seven = _mm256_set1_epi64x(7);
+    const __m256i sixty_three = _mm256_set1_epi64x(63);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i last_word = _mm256_set1_epi64x((long long) bf->size - 4);
+    const __m256i lane_ids = _mm256_setr_epi64x(0, 1, 2, 3);
+    const __m256i even_dwords = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    bloom_lanes *lanes = bf->lanes;
+    uint64_t k = bf->num_partitions;
+    uint64_t total = count * k;
+    uint64_t key = 0;
+    uint64_t r = 0;
+
+    for (uint64_t lane = 0; lane < total; lane += 4) {
+        __m256i valid = _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long) (total - lane)), lane_ids);
+        __m256i bit = _mm256_loadu_si256((const __m256i *) (bits + lane));
+        __m256i set;
+        if (bf->flags & BLOOM_WORD_PROBES) {
+            // Aligned arrays are whole words, so the aligned 64 bit word holding each bit is gathered as is
+            __m256i words = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), (const long long *) bf->bloom_ptr,
+                                                        _mm256_srli_epi64(bit, 6), valid, 8);
+            set = _mm256_and_si256(_mm256_srlv_epi64(words, _mm256_and_si256(bit, sixty_three)), one);
+        } else {
+            // Gather the 32 bit word holding each bit, clamped so it never reads past the end of the array
+            __m256i byte = _mm256_srli_epi64(bit, 3);
+            __m256i addr = _mm256_blendv_epi8(byte, last_word, _mm256_cmpgt_epi64(byte, last_word));
+            __m256i shift = _mm256_add_epi64(_mm256_slli_epi64(_mm256_sub_epi64(byte, addr), 3),
+                                             _mm256_and_si256(bit, seven));
+            __m128i word_mask = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(valid, even_dwords));
+            __m128i words = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int *) bf->bloom_ptr, addr,
+                                                        word_mask, 1);
+            set = _mm256_and_si256(_mm256_srlv_epi64(_mm256_cvtepu32_epi64(words), shift), one);
+        }
+
+        // Branch free, as a mispredict would flush the gathers in flight
+        unsigned absent = (unsigned) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_andnot_si256(
+            _mm256_cmpeq_epi64(set, one), valid)));
+        const uint64_t *key_delta = lanes->keys + r * 8;
+        for (int l = 0; l < 4; l++) {
+            absent_keys[key + key_delta[l]] |= (absent >> l) & 1;
+        }
+        bloom_lanes_advance(&r, &key, 4, k);
+    }
+    memcpy(results, absent_keys, count);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d bloom_u32_to_pd_avx512(__m512i x) {
+    __m512i magic = _mm512_set1_epi64(BLOOM_MAGIC_52);
+    return _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(x, magic)), _mm512_castsi512_pd(magic));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i bloom_floor_u52_avx512(__m512d x) {
+    __m512d magic = _mm512_castsi512_pd(_mm512_set1_epi64(BLOOM_MAGIC_52));
+    __m512d floored = _mm512_roundscale_pd(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512i bits = _mm512_castpd_si512(_mm512_add_pd(floored, magic));
+    return _mm512_and_si512(bits, _mm512_set1_epi64((1ULL << 52) - 1));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i bloom_correct_avx512(__m512i x, __m512i p) {
+    x = _mm512_mask_add_epi64(x, _mm512_cmplt_epi64_mask(x, _mm512_setzero_si512()), x, p);
+    return _mm512_mask_sub_epi64(x, _mm512_cmpge_epi64_mask(x, p), x, p);
+}
+
+__attribute__((target("avx512f")))
+static void bloom_index_avx512(bloom *bf, const uint64_t *hashes, uint64_t count, uint64_t *bits) {
+    uint64_t part_hashes[BLOOM_BATCH_SIZE + 8] = {0};
+    uint64_t blocks[BLOOM_BATCH_SIZE + 8] = {0};
+    bloom_lanes_prepare(bf, hashes, count, part_hashes, blocks);
+
+    const __m512i low32 = _mm512_set1_epi64(0xffffffff);
+    const __m512d two32 = _mm512_set1_pd(4294967296.0);
+    const __m512d max_q = _mm512_set1_pd(4294967295.0);
+    bloom_lanes *lanes = bf->lanes;
+    uint64_t k = bf->num_partitions;
+    uint64_t total = count * k;
+    uint64_t key = 0;
+    uint64_t r = 0;
+
+    for (uint64_t lane = 0; lane < total; lane += 8) {
+        __m512i p = _mm512_loadu_si512(lanes->lengths + r * 8);
+        __m512d inv = _mm512_loadu_pd(lanes->inverse + r * 8);
+        __m512i off = _mm512_loadu_si512(lanes->offsets + r * 8);
+        __m512i key_idx = _mm512_loadu_si512(lanes->keys + r * 8);
+        __m512i h = _mm512_permutexvar_epi64(key_idx, _mm512_loadu_si512(part_hashes + key));
+        __m512i base = _mm512_permutexvar_epi64(key_idx, _mm512_loadu_si512(blocks + key));
+
+        __m512i h_hi = _mm512_srli_epi64(h, 32);
+        __m512i q = bloom_floor_u52_avx512(_mm512_mul_pd(bloom_u32_to_pd_avx512(h_hi), inv));
+        __m512i rem = bloom_correct_avx512(_mm512_sub_epi64(h_hi, _mm512_mul_epu32(q, p)), p);
+
+        __m512i t = _mm512_add_epi64(_mm512_slli_epi64(rem, 32), _mm512_and_si512(h, low32));
+        __m512d t_d = _mm512_add_pd(_mm512_mul_pd(bloom_u32_to_pd_avx512(_mm512_srli_epi64(t, 32)), two32),
+                                    bloom_u32_to_pd_avx512(_mm512_and_si512(t, low32)));
+        q = bloom_floor_u52_avx512(_mm512_min_pd(_mm512_mul_pd(t_d, inv), max_q));
+        rem = bloom_correct_avx512(_mm512_sub_epi64(t, _mm512_mul_epu32(q, p)), p);
+
+        _mm512_storeu_si512(bits + lane, _mm512_add_epi64(_mm512_add_epi64(base, off), rem));
+        bloom_lanes_advance(&r, &key, 8, k);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void bloom_probe_avx512(bloom *bf, const uint64_t *bits, uint64_t count, uint8_t *results) {
+    uint8_t absent_keys[BLOOM_BATCH_SIZE + 8] = {0};
+    const __m512i seven = _mm512_set1_epi64(7);
+    const __m512i sixty_three = _mm512_set1_epi64(63);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i last_word = _mm512_set1_epi64((long long) bf->size - 4);
+    bloom_lanes *lanes = bf->lanes;
+    uint64_t k = bf->num_partitions;
+    uint64_t total = count * k;
+    uint64_t key = 0;
+    uint64_t r = 0;
+
+    for (uint64_t lane = 0; lane < total; lane += 8) {
+        __mmask8 valid = total - lane >= 8 ? 0xff : (__mmask8) ((1U << (total - lane)) - 1);
+        __m512i bit = _mm512_loadu_si512(bits + lane);
+        __m512i set;
+        if (bf->flags & BLOOM_WORD_PROBES) {
+            __m512i words = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), valid, _mm512_srli_epi64(bit, 6),
+                                                        bf->bloom_ptr, 8);
+            set = _mm512_and_si512(_mm512_srlv_epi64(words, _mm512_and_si512(bit, sixty_three)), one);
+        } else {
+            __m512i byte = _mm512_srli_epi64(bit, 3);
+            __m512i addr = _mm512_min_epu64(byte, last_word);
+            __m512i shift = _mm512_add_epi64(_mm512_slli_epi64(_mm512_sub_epi64(byte, addr), 3),
+                                             _mm512_and_si512(bit, seven));
+            __m256i words = _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), valid, addr, bf->bloom_ptr, 1);
+            set = _mm512_and_si512(_mm512_srlv_epi64(_mm512_cvtepu32_epi64(words), shift), one);
+        }
+
+        unsigned absent = valid & ~_mm512_test_epi64_mask(set, set);
+        const uint64_t *key_delta = lanes->keys + r * 8;
+        for (int l = 0; l < 8; l++) {
+            absent_keys[key + key_delta[l]] |= (absent >> l) & 1;
+        }
+        bloom_lanes_advance(&r, &key, 8, k);
+    }
+    memcpy(results, absent_keys, count);
+}
+
+// Byte-wise population count by nibble lookup (Mula), summed per 64 bit lane
+__attribute__((target("avx2")))
+static inline __m256i bloom_popcount_avx2(__m256i v) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low4));
+    __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t bloom_hsum_avx2(__m256i v) {
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return (uint64_t) _mm_cvtsi128_si64(sum) + (uint64_t) _mm_extract_epi64(sum, 1);
+}
+
+__attribute__((target("avx2")))
+static void bloom_merge_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint64_t len, int op,
+                             uint64_t *pop) {
+    __m256i pop_res = _mm256_setzero_si256();
+    __m256i pop_a = _mm256_setzero_si256();
+    __m256i pop_b = _mm256_setzero_si256();
+    uint64_t vectors = len / 32;
+    for (uint64_t i = 0; i < vectors; i++) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i * 32));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i * 32));
+        __m256i res = op == BLOOM_MERGE_OR ? _mm256_or_si256(va, vb) : _mm256_and_si256(va, vb);
+        pop_res = _mm256_add_epi64(pop_res, bloom_popcount_avx2(res));
+        pop_a = _mm256_add_epi64(pop_a, bloom_popcount_avx2(va));
+        pop_b = _mm256_add_epi64(pop_b, bloom_popcount_avx2(vb));
+        _mm256_storeu_si256((__m256i *) (dst + i * 32), res);
+    }
+    pop[0] += bloom_hsum_avx2(pop_res);
+    pop[1] += bloom_hsum_avx2(pop_a);
+    pop[2] += bloom_hsum_avx2(pop_b);
+    bloom_merge_tail(dst, a, b, vectors * 32, len, op, pop);
+}
+#endif
+
+typedef struct bloom_kernel_fns {
+    bloom_index_fn index;
+    bloom_probe_fn probe;
+    bloom_merge_fn merge;
+} bloom_kernel_fns;
+
+// Indexed by BLOOM_KERNEL_*. The selection is a single int read and written atomically, so threads selecting
+// or using kernels concurrently always see one consistent set of functions
+static const bloom_kernel_fns bloom_kernels[] = {
+    {bloom_index_scalar, bloom_probe_scalar, bloom_merge_scalar},
+#if defined(__x86_64__)
+    {bloom_index_avx2, bloom_probe_avx2, bloom_merge_avx2},
+    {bloom_index_avx512, bloom_probe_avx512, bloom_merge_avx2},
+#endif
+};
+static int bloom_kernel = -1;
+
+static inline int bloom_supported_kernel(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return BLOOM_KERNEL_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return BLOOM_KERNEL_AVX2;
+    }
+#endif
+    return BLOOM_KERNEL_SCALAR;
+}
+
+int bloom_select_kernel(int kernel) {
+    int supported = bloom_supported_kernel();
+    if (kernel == BLOOM_KERNEL_AUTO) {
+        kernel = supported;
+    }
+    if (kernel < BLOOM_KERNEL_SCALAR || kernel > supported) {
+        return -1;
+    }
+    __atomic_store_n(&bloom_kernel, kernel, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// The first call picks the best supported kernel unless one was selected, and threads racing to it agree
+// on the result through the compare and swap
+int bloom_active_kernel(void) {
+    int kernel = __atomic_load_n(&bloom_kernel, __ATOMIC_RELAXED);
+    if (kernel < 0) {
+        int unset = -1;
+        kernel = bloom_supported_kernel();
+        if (!__atomic_compare_exchange_n(&bloom_kernel, &unset, kernel, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            kernel = unset;
+        }
+    }
+    return kernel;
+}
+
+// The kernel a batch call uses from start to end, read once so that a concurrent bloom_select_kernel cannot mix
+// two kernels within the call. Filters without lane tables always take the scalar kernel.
+static inline int bloom_batch_kernel(bloom *bf) {
+    return bf->lanes ? bloom_active_kernel() : BLOOM_KERNEL_SCALAR;
+}
+
+static inline void bloom_index(bloom *bf, int kernel, const uint64_t *hashes, uint64_t count, uint64_t *bits) {
+    if (kernel != BLOOM_KERNEL_SCALAR) {
+        bloom_kernels[kernel].index(bf, hashes, count, bits);
+    } else {
+        bloom_index_scalar(bf, hashes, count, bits);
+    }
+}
+
+static inline void bloom_probe(bloom *bf, int kernel, const uint64_t *bits, uint64_t count, uint8_t *results) {
+    if (kernel != BLOOM_KERNEL_SCALAR) {
+        bloom_kernels[kernel].probe(bf, bits, count, results);
+    } else {
+        bloom_probe_scalar(bf, bits, count, results);
+    }
+}
+
+static inline void bloom_free_lanes(bloom_lanes *lanes) {
+    if (!lanes) {
+        return;
+    }
+    free(lanes->lengths);
+    free(lanes->inverse);
+    free(lanes->offsets);
+    free(lanes->keys);
+    free(lanes);
+}
+
+// Sets up the lane tables the vector kernels need, leaving them NULL when the kernels cannot be used. They are
+// built whenever the CPU has a vector kernel, even while the scalar one is selected, so a filter created then
+// still takes a vector kernel selected later.
+static inline int bloom_init_lanes(bloom *bf) {
+    if (bloom_supported_kernel() == BLOOM_KERNEL_SCALAR || bf->size < 4
+        || bf->flags & (BLOOM_COUNTING | BLOOM_LARGE)) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        if (bf->partition_lengths[i] >= (1ULL << 31)) {
+            return 0;
+        }
+    }
+
+    uint64_t rows = bf->num_partitions * 8;
+    bloom_lanes *lanes = calloc(1, sizeof *lanes);
+    if (!lanes) {
+        return -1;
+    }
+    lanes->lengths = calloc(rows, sizeof *lanes->lengths);
+    lanes->inverse = calloc(rows, sizeof *lanes->inverse);
+    lanes->offsets = calloc(rows, sizeof *lanes->offsets);
+    lanes->keys = calloc(rows, sizeof *lanes->keys);
+    if (!lanes->lengths || !lanes->inverse || !lanes->offsets || !lanes->keys) {
+        bloom_free_lanes(lanes);
+        return -1;
+    }
+
+    for (uint64_t r = 0; r < bf->num_partitions; r++) {
+        for (uint64_t lane = 0; lane < 8; lane++) {
+            uint64_t part = (r + lane) % bf->num_partitions;
+            lanes->lengths[r * 8 + lane] = bf->partition_lengths[part];
+            lanes->inverse[r * 8 + lane] = 1.0 / (double) bf->partition_lengths[part];
+            lanes->offsets[r * 8 + lane] = bf->partition_offsets[part];
+            lanes->keys[r * 8 + lane] = (r + lane) / bf->num_partitions;
+        }
+    }
+    bf->lanes = lanes;
+    return 0;
+}
+
+static uint64_t bloom_hash_xxh64(const void *data, size_t len, uint64_t seed) {
+    return XXH64(data, len, seed);
+}
+
+static uint64_t bloom_hash_xxh3(const void *data, size_t len, uint64_t seed) {
+    return XXH3_64bits_withSeed(data, len, seed);
+}
+
+static bloom_hash_fn bloom_hash_fns[BLOOM_HASH_MAX] = {
+    [BLOOM_HASH_XXH64] = bloom_hash_xxh64,
+    [BLOOM_HASH_XXH3] = bloom_hash_xxh3,
+};
+
+#if BLOOM_HASH_DEFAULT != BLOOM_HASH_XXH64 && BLOOM_HASH_DEFAULT != BLOOM_HASH_XXH3
+#error "BLOOM_HASH_DEFAULT must name a built in hash"
+#endif
+
+// Whether a filter uses the given hash. A pinned build only ever holds filters using BLOOM_HASH_DEFAULT, so the
+// test is a constant and every hash below compiles to that one alone.
+static inline bool bloom_hash_is(bloom *bf, uint32_t hash_id) {
+#ifdef BLOOM_HASH_PINNED
+    (void) bf;
+    return hash_id == BLOOM_HASH_DEFAULT;
+#else
+    return bf->hash_id == hash_id;
+#endif
+}
+
+static inline uint64_t bloom_hash(bloom *bf, const void *data, uint64_t data_len) {
+    if (bloom_hash_is(bf, BLOOM_HASH_XXH64)) {
+        return XXH64(data, data_len, bf->hash_seed);
+    }
+    if (bloom_hash_is(bf, BLOOM_HASH_XXH3)) {
+        return XXH3_64bits_withSeed(data, data_len, bf->hash_seed);
+    }
+    return bf->hash_fn(data, data_len, bf->hash_seed);
+}
+
+// The hash a key is probed with. Large filters take a 128 bit hash: XXH3's own, or for other hashes two
+// 64 bit hashes of the key under different seeds.
+static inline bloom_wide_hash bloom_hash_wide(bloom *bf, const void *data, uint64_t data_len) {
+    if (__builtin_expect(!(bf->flags & BLOOM_LARGE), 1)) {
+        return bloom_hash(bf, data, data_len);
+    }
+    if (bloom_hash_is(bf, BLOOM_HASH_XXH3)) {
+        XXH128_hash_t hash = XXH3_128bits_withSeed(data, data_len, bf->hash_seed);
+        return (bloom_wide_hash) hash.high64 << 64 | hash.low64;
+    }
+    uint64_t high = bf->hash_fn(data, data_len, bf->hash_seed ^ 0x9E3779B97F4A7C15ULL);
+    return (bloom_wide_hash) high << 64 | bf->hash_fn(data, data_len, bf->hash_seed);
+}
+
+// bloom_hash_wide for keys of a constant length of up to 128 bytes. The built in hashes are entered below their
+// length dispatch, so each call site compiles to the straight-line code for its length, with the same result.
+static inline __attribute__((always_inline)) bloom_wide_hash bloom_hash_fixed(bloom *bf, const void *data,
+                                                                             size_t len) {
+    if (bf->flags & BLOOM_LARGE) {
+        return bloom_hash_wide(bf, data, len);
+    }
+    if (bloom_hash_is(bf, BLOOM_HASH_XXH64)) {
+        return XXH64_endian_align(data, len, bf->hash_seed, XXH_unaligned);
+    }
+    if (bloom_hash_is(bf, BLOOM_HASH_XXH3)) {
+        if (len <= 16) {
+            return XXH3_len_0to16_64b(data, len, XXH3_kSecret, bf->hash_seed);
+        }
+        return XXH3_len_17to128_64b(data, len, XXH3_kSecret, sizeof XXH3_kSecret, bf->hash_seed);
+    }
+    return bf->hash_fn(data, len, bf->hash_seed);
+}
+
+static inline int bloom_init_hash(bloom *bf, uint32_t hash_id, uint64_t seed) {
+    if (hash_id >= BLOOM_HASH_MAX || !bloom_hash_fns[hash_id]) {
+        return -1;
+    }
+#ifdef BLOOM_HASH_PINNED
+    if (hash_id != BLOOM_HASH_DEFAULT) {
+        return -1;
+    }
+#endif
+    bf->hash_fn = bloom_hash_fns[hash_id];
+    bf->hash_id = hash_id;
+    bf->hash_seed = seed;
+    return 0;
+}
+
+int bloom_register_hash(uint32_t hash_id, bloom_hash_fn fn) {
+    if (hash_id < BLOOM_HASH_CUSTOM || hash_id >= BLOOM_HASH_MAX || !fn) {
+        return -1;
+    }
+    bloom_hash_fns[hash_id] = fn;
+    return 0;
+}
+
+int bloom_use_hash(bloom *bf, uint32_t hash_id, uint64_t seed) {
+    if (!bf || bloom_get_num_elems(bf)) {
+        return -1;
+    }
+    return bloom_init_hash(bf, hash_id, seed);
+}
+
+int bloom_add(bloom *bf, uint8_t *data, uint64_t data_len) {
+    if (!bf || !data || !data_len || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    bloom_set_hash(bf, bloom_hash_wide(bf, data, data_len));
+    bloom_count_elems(bf, 1);
+    return 0;
+}
+
+int bloom_test(bloom *bf, uint8_t *data, uint64_t data_len) {
+    if (!bf || !data || !data_len) {
+        return -1;
+    }
+
+    return bloom_check_hash(bf, bloom_hash_wide(bf, data, data_len));
+}
+
+int bloom_test_and_add(bloom *bf, uint8_t *data, uint64_t data_len) {
+    if (!bf || !data || !data_len || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    return bloom_test_and_set_hash(bf, bloom_hash_wide(bf, data, data_len));
+}
+
+static inline __attribute__((always_inline)) int bloom_add_fixed(bloom *bf, const void *key, size_t len) {
+    if (!bf || !key || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    bloom_set_hash(bf, bloom_hash_fixed(bf, key, len));
+    bloom_count_elems(bf, 1);
+    return 0;
+}
+
+static inline __attribute__((always_inline)) int bloom_test_fixed(bloom *bf, const void *key, size_t len) {
+    if (!bf || !key) {
+        return -1;
+    }
+
+    return bloom_check_hash(bf, bloom_hash_fixed(bf, key, len));
+}
+
+int bloom_add_u32(bloom *bf, uint32_t key) {
+    return bloom_add_fixed(bf, &key, sizeof key);
+}
+
+int bloom_test_u32(bloom *bf, uint32_t key) {
+    return bloom_test_fixed(bf, &key, sizeof key);
+}
+
+int bloom_add_u64(bloom *bf, uint64_t key) {
+    return bloom_add_fixed(bf, &key, sizeof key);
+}
+
+int bloom_test_u64(bloom *bf, uint64_t key) {
+    return bloom_test_fixed(bf, &key, sizeof key);
+}
+
+int bloom_add_fixed16(bloom *bf, const uint8_t *key) {
+    return bloom_add_fixed(bf, key, 16);
+}
+
+int bloom_test_fixed16(bloom *bf, const uint8_t *key) {
+    return bloom_test_fixed(bf, key, 16);
+}
+
+int bloom_add_fixed32(bloom *bf, const uint8_t *key) {
+    return bloom_add_fixed(bf, key, 32);
+}
+
+int bloom_test_fixed32(bloom *bf, const uint8_t *key) {
+    return bloom_test_fixed(bf, key, 32);
+}
+
+int bloom_remove(bloom *bf, uint8_t *data, uint64_t data_len) {
+    if (!bf || !(bf->flags & BLOOM_COUNTING) || !data || !data_len || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    bloom_wide_hash hash = bloom_hash_wide(bf, data, data_len);
+    if (bloom_check_hash(bf, hash)) {
+        return 1;
+    }
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        if (bloom_dec_counter(bf, bloom_bit_index(bf, 0, hash, i)) && bf->partition_fill) {
+            bloom_track_fill(bf, i, -1);
+        }
+    }
+    bf->num_elems -= bf->num_elems ? 1 : 0;
+    return 0;
+}
+
+uint64_t bloom_key_hash(bloom *bf, uint8_t *data, uint64_t data_len) {
+    if (!bf || !data) {
+        return 0;
+    }
+    return bloom_hash(bf, data, data_len);
+}
+
+// A 64 bit hash cannot stand in for the 128 bit hash of a large filter
+int bloom_add_hash(bloom *bf, uint64_t hash) {
+    if (!bf || bf->flags & BLOOM_LARGE || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    bloom_set_hash(bf, hash);
+    bloom_count_elems(bf, 1);
+    return 0;
+}
+
+int bloom_test_hash(bloom *bf, uint64_t hash) {
+    if (!bf || bf->flags & BLOOM_LARGE) {
+        return -1;
+    }
+    return bloom_check_hash(bf, hash);
+}
+
+int bloom_test_and_add_hash(bloom *bf, uint64_t hash) {
+    if (!bf || bf->flags & BLOOM_LARGE || bloom_read_only(bf)) {
+        return -1;
+    }
+    return bloom_test_and_set_hash(bf, hash);
+}
+
+int bloom_test_many(bloom **filters, uint64_t num_filters, uint8_t *data, uint64_t data_len, uint8_t *results) {
+    if (!filters || !results || !data || !data_len) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < num_filters; i++) {
+        if (!filters[i] || filters[i]->hash_id != filters[0]->hash_id
+            || filters[i]->hash_seed != filters[0]->hash_seed || filters[i]->flags & BLOOM_LARGE) {
+            return -1;
+        }
+    }
+    if (!num_filters) {
+        return 0;
+    }
+
+    // Prefetch a group of filters before probing any, so their cache misses overlap
+    uint64_t hash = bloom_hash(filters[0], data, data_len);
+    for (uint64_t start = 0; start < num_filters; start += BLOOM_BATCH_SIZE) {
+        uint64_t end = num_filters - start < BLOOM_BATCH_SIZE ? num_filters : start + BLOOM_BATCH_SIZE;
+        for (uint64_t i = start; i < end; i++) {
+            bloom_prefetch_hash(filters[i], hash);
+        }
+        for (uint64_t i = start; i < end; i++) {
+            results[i] = bloom_check_hash(filters[i], hash);
+        }
+    }
+    return 0;
+}
+
+// Filters can be combined when their bit arrays line up slot for slot. Counting filters cannot, as their
+// counters do not combine with bitwise operations.
+static inline bool bloom_compatible(bloom *a, bloom *b) {
+    if (!a || !b || !a->bloom_ptr || !b->bloom_ptr || a->num_partitions != b->num_partitions
+        || a->size != b->size || a->num_blocks != b->num_blocks || (a->flags | b->flags) & BLOOM_COUNTING
+        || (a->flags ^ b->flags) & (BLOOM_BLOCKED | BLOOM_LARGE | BLOOM_ALIGNED) || a->hash_id != b->hash_id
+        || a->hash_seed != b->hash_seed) {
+        return false;
+    }
+    return !memcmp(a->partition_lengths, b->partition_lengths, a->num_partitions * sizeof(uint64_t));
+}
+
+// Estimated number of distinct keys that set 'set_bits' of the filter's slots. Every key sets one slot per
+// partition, so with m slots in all a fraction 1 - e^(-nk/m) of them is expected to be set.
+static inline double bloom_estimate_keys(bloom *bf, uint64_t set_bits) {
+    double slots = 0;
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        slots += bf->partition_lengths[i];
+    }
+    if (bf->flags & BLOOM_BLOCKED) {
+        slots *= bf->num_blocks;
+    }
+    double fill = set_bits < slots ? set_bits / slots : (slots - 1) / slots;
+    return -slots / bf->num_partitions * log(1 - fill);
+}
+
+BLOOM_POPCNT_CLONES
+static uint64_t bloom_popcount_range(const uint8_t *p, uint64_t start, uint64_t len) {
+    uint64_t end = start + len;
+    uint64_t count = 0;
+    for (; start < end && start % 8; start++) {
+        count += p[start / 8] >> start % 8 & 1;
+    }
+    for (; end - start >= 64; start += 64) {
+        uint64_t word;
+        memcpy(&word, p + start / 8, 8);
+        count += __builtin_popcountll(word);
+    }
+    for (; end - start >= 8; start += 8) {
+        count += __builtin_popcount(p[start / 8]);
+    }
+    for (; start < end; start++) {
+        count += p[start / 8] >> start % 8 & 1;
+    }
+    return count;
+}
+
+// Non-zero counters in a run of bytes: each counter's bits are folded into its lowest bit, and those counted
+BLOOM_POPCNT_CLONES
+static uint64_t bloom_count_counters(const uint8_t *p, uint64_t len) {
+    const uint64_t low_bits = UINT64_MAX / BLOOM_COUNTER_MAX;
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < len; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, p + i, len - i < 8 ? len - i : 8);
+        uint64_t folded = word;
+        for (int shift = 1; shift < BLOOM_COUNTER_BITS; shift++) {
+            folded |= word >> shift;
+        }
+        count += __builtin_popcountll(folded & low_bits);
+    }
+    return count;
+}
+
+// Counts the occupied slots of every partition
+static void bloom_count_fill(bloom *bf, uint64_t *fill) {
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        uint64_t len = bf->partition_lengths[i];
+        uint64_t count = 0;
+        if (bf->flags & BLOOM_COUNTING) {
+            count = bloom_count_counters(bf->partition_ptrs[i], (len * BLOOM_COUNTER_BITS + 7) / 8);
+        } else if (bf->flags & BLOOM_BLOCKED) {
+            for (uint64_t b = 0; b < bf->num_blocks; b++) {
+                count += bloom_popcount_range(bf->bloom_ptr, b * BLOOM_BLOCK_BITS + bf->partition_offsets[i], len);
+            }
+        } else {
+            count = bloom_popcount_range(bf->bloom_ptr, bf->partition_offsets[i], len);
+        }
+        __atomic_store_n(&fill[i], count, __ATOMIC_RELAXED);
+    }
+}
+
+// A partition of m slots of which x are set has seen about -m ln(1 - x/m) distinct keys, and a key not in
+// the filter finds its slot set with probability x/m. The estimates use the tracked fill when there is one.
+static int bloom_fill_stats(bloom *bf, double *count, double *fpr) {
+    if (!bf || !bf->num_partitions || !bf->bloom_ptr) {
+        return -1;
+    }
+    // The fill is a function of the array alone, so the first count after an attach replaces whatever the adds
+    // since then tracked. A concurrent add racing the count may be missed, which only skews the estimates.
+    if (__atomic_load_n(&bf->fill_pending, __ATOMIC_ACQUIRE)) {
+        bloom_count_fill(bf, bf->partition_fill);
+        __atomic_store_n(&bf->fill_pending, false, __ATOMIC_RELEASE);
+    }
+    uint64_t *fill = bf->partition_fill;
+    if (!fill) {
+        fill = malloc(bf->num_partitions * sizeof *fill);
+        if (!fill) {
+            return -1;
+        }
+        bloom_count_fill(bf, fill);
+    }
+
+    *count = 0.0;
+    *fpr = 1.0;
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        double slots = (double) bf->partition_lengths[i] * (bf->flags & BLOOM_BLOCKED ? bf->num_blocks : 1);
+        double set = (double) __atomic_load_n(&fill[i], __ATOMIC_RELAXED);
+        set = set < slots ? set : slots - 1;
+        *count += -slots * log1p(-set / slots);
+        *fpr *= set / slots;
+    }
+    *count /= bf->num_partitions;
+
+    if (fill != bf->partition_fill) {
+        free(fill);
+    }
+    return 0;
+}
+
+uint64_t bloom_estimate_count(bloom *bf) {
+    double count, fpr;
+    if (bloom_fill_stats(bf, &count, &fpr)) {
+        return 0;
+    }
+    return (uint64_t) llround(count);
+}
+
+// Keys spread unevenly over the blocks of a blocked filter, and the fuller blocks raise the rate above the
+// product of the average fill ratios, so it comes from the block load model at the estimated count instead
+double bloom_current_fpr(bloom *bf) {
+    double count, fpr;
+    if (bloom_fill_stats(bf, &count, &fpr)) {
+        return -1.0;
+    }
+    if (bf->flags & BLOOM_BLOCKED) {
+        return count > 0 ? bloom_blocked_fpr(count, bf->num_blocks, bf->partition_lengths, bf->num_partitions) : 0.0;
+    }
+    return fpr;
+}
+
+static inline void bloom_set_num_elems(bloom *bf, uint64_t num_elems) {
+    if (bf->flags & BLOOM_CONCURRENT) {
+        memset(bf->elem_stripes, 0, BLOOM_COUNTER_STRIPES * BLOOM_STRIPE_WORDS * sizeof(uint64_t));
+        bf->elem_stripes[0] = num_elems;
+    } else {
+        bf->num_elems = num_elems;
+    }
+}
+
+// Runs the merge kernel over both arrays and sets the element count of dst from the fill of a, b and
+// their union: the union count lies between the larger input and the sum of both, the intersection count
+// between 0 and the smaller input.
+static inline int bloom_merge(bloom *dst, bloom *a, bloom *b, int op) {
+    if (!bloom_compatible(dst, a) || !bloom_compatible(a, b) || bloom_read_only(dst)) {
+        return -1;
+    }
+
+    uint64_t num_a = bloom_get_num_elems(a);
+    uint64_t num_b = bloom_get_num_elems(b);
+    uint64_t pop[3] = {0};
+    bloom_kernels[bloom_active_kernel()].merge(dst->bloom_ptr, a->bloom_ptr, b->bloom_ptr, a->size, op, pop);
+
+    uint64_t pop_union = op == BLOOM_MERGE_OR ? pop[0] : pop[1] + pop[2] - pop[0];
+    double est_a = bloom_estimate_keys(a, pop[1]);
+    double est_b = bloom_estimate_keys(b, pop[2]);
+    double est_union = bloom_estimate_keys(a, pop_union);
+    double lo, hi, est;
+    if (op == BLOOM_MERGE_OR) {
+        lo = num_a > num_b ? num_a : num_b;
+        hi = (double) num_a + num_b;
+        est = est_union;
+    } else {
+        lo = 0;
+        hi = num_a < num_b ? num_a : num_b;
+        est = est_a + est_b - est_union;
+    }
+    bloom_set_num_elems(dst, (uint64_t) llround(est < lo ? lo : est > hi ? hi : est));
+    if (dst->partition_fill) {
+        bloom_count_fill(dst, dst->partition_fill);
+        dst->fill_pending = false;
+    }
+    return 0;
+}
+
+int bloom_union(bloom *dst, bloom *a, bloom *b) {
+    return bloom_merge(dst, a, b, BLOOM_MERGE_OR);
+}
+
+int bloom_intersect(bloom *dst, bloom *a, bloom *b) {
+    return bloom_merge(dst, a, b, BLOOM_MERGE_AND);
+}
+
+double bloom_jaccard_estimate(bloom *a, bloom *b) {
+    if (!bloom_compatible(a, b)) {
+        return -1.0;
+    }
+
+    uint64_t pop[3] = {0};
+    uint64_t len = a->size;
+    uint8_t *scratch = malloc(BLOOM_BLOCK_BYTES * 64);
+    if (!scratch) {
+        return -1.0;
+    }
+    // The union is only counted, so it is written to a small scratch buffer a chunk at a time
+    bloom_merge_fn merge = bloom_kernels[bloom_active_kernel()].merge;
+    for (uint64_t start = 0; start < len; start += BLOOM_BLOCK_BYTES * 64) {
+        uint64_t chunk = len - start < BLOOM_BLOCK_BYTES * 64 ? len - start : BLOOM_BLOCK_BYTES * 64;
+        merge(scratch, a->bloom_ptr + start, b->bloom_ptr + start, chunk, BLOOM_MERGE_OR, pop);
+    }
+    free(scratch);
+
+    double est_union = bloom_estimate_keys(a, pop[0]);
+    if (est_union <= 0) {
+        return 0.0;
+    }
+    double est_both = bloom_estimate_keys(a, pop[1]) + bloom_estimate_keys(b, pop[2]) - est_union;
+    double jaccard = est_both / est_union;
+    return jaccard < 0 ? 0.0 : jaccard > 1 ? 1.0 : jaccard;
+}
+
+// bloom_index for one key of a large filter, whose 128 bit hash the vector kernels cannot take
+static inline void bloom_index_wide(bloom *bf, bloom_wide_hash hash, uint64_t *bits) {
+    for (uint64_t i = 0; i < bf->num_partitions; i++) {
+        bits[i] = bloom_bit_index(bf, 0, hash, i);
+    }
+}
+
+// Hashes a group of keys up front, computes all their bit indexes and prefetches every partition byte
+// they map to, so the cache misses for the whole group overlap instead of being paid one key at a time.
+static inline int bloom_index_group(bloom *bf, int kernel, uint8_t *keys, const uint64_t *offsets, uint64_t count,
+                                    uint64_t *bits, int rw) {
+    uint64_t hashes[BLOOM_BATCH_SIZE];
+    for (uint64_t j = 0; j < count; j++) {
+        uint64_t key_len = offsets[j + 1] - offsets[j];
+        if (!key_len) {
+            return -1;
+        }
+        if (bf->flags & BLOOM_LARGE) {
+            bloom_index_wide(bf, bloom_hash_wide(bf, keys + offsets[j], key_len), bits + j * bf->num_partitions);
+        } else {
+            hashes[j] = bloom_hash(bf, keys + offsets[j], key_len);
+        }
+    }
+
+    if (!(bf->flags & BLOOM_LARGE)) {
+        bloom_index(bf, kernel, hashes, count, bits);
+    }
+    bloom_prefetch_bits(bf, bits, count, rw);
+    return 0;
+}
+
+static inline uint64_t *bloom_alloc_bits(bloom *bf) {
+    return malloc((BLOOM_BATCH_SIZE * bf->num_partitions + 8) * sizeof(uint64_t));
+}
+
+// Sets the bits of a group of keys indexed by bloom_index and counts the keys
+static inline void bloom_set_group(bloom *bf, const uint64_t *bits, uint64_t count) {
+    if (bf->partition_fill) {
+        for (uint64_t i = 0; i < count * bf->num_partitions; i++) {
+            if (bloom_set_bit(bf, bits[i])) {
+                bloom_track_fill(bf, i % bf->num_partitions, 1);
+            }
+        }
+    } else {
+        for (uint64_t i = 0; i < count * bf->num_partitions; i++) {
+            bloom_set_bit(bf, bits[i]);
+        }
+    }
+    bloom_count_elems(bf, count);
+}
+
+int bloom_add_batch(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count) {
+    if (!bf || !keys || !offsets || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    uint64_t *bits = bloom_alloc_bits(bf);
+    if (!bits) {
+        return -1;
+    }
+    int kernel = bloom_batch_kernel(bf);
+
+    int res = 0;
+    for (uint64_t start = 0; start < count; start += BLOOM_BATCH_SIZE) {
+        uint64_t group = count - start < BLOOM_BATCH_SIZE ? count - start : BLOOM_BATCH_SIZE;
+        if (bloom_index_group(bf, kernel, keys, offsets + start, group, bits, 1)) {
+            res = -1;
+            break;
+        }
+
+        bloom_set_group(bf, bits, group);
+    }
+
+    free(bits);
+    return res;
+}
+
+int bloom_add_hash_batch(bloom *bf, const uint64_t *hashes, uint64_t count) {
+    if (!bf || !hashes || bf->flags & BLOOM_LARGE || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    uint64_t *bits = bloom_alloc_bits(bf);
+    if (!bits) {
+        return -1;
+    }
+    int kernel = bloom_batch_kernel(bf);
+
+    for (uint64_t start = 0; start < count; start += BLOOM_BATCH_SIZE) {
+        uint64_t group = count - start < BLOOM_BATCH_SIZE ? count - start : BLOOM_BATCH_SIZE;
+        bloom_index(bf, kernel, hashes + start, group, bits);
+        bloom_prefetch_bits(bf, bits, group, 1);
+        bloom_set_group(bf, bits, group);
+    }
+
+    free(bits);
+    return 0;
+}
+
+int bloom_test_batch(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count, uint8_t *results) {
+    if (!bf || !keys || !offsets || !results) {
+        return -1;
+    }
+
+    uint64_t *bits = bloom_alloc_bits(bf);
+    if (!bits) {
+        return -1;
+    }
+    int kernel = bloom_batch_kernel(bf);
+
+    int res = 0;
+    for (uint64_t start = 0; start < count; start += BLOOM_BATCH_SIZE) {
+        uint64_t group = count - start < BLOOM_BATCH_SIZE ? count - start : BLOOM_BATCH_SIZE;
+        if (bloom_index_group(bf, kernel, keys, offsets + start, group, bits, 0)) {
+            res = -1;
+            break;
+        }
+
+        bloom_probe(bf, kernel, bits, group, results + start);
+    }
+
+    free(bits);
+    return res;
+}
+
+// bloom_test_and_set_hash for the slots of one key indexed by bloom_index
+static inline int bloom_test_and_set_bits(bloom *bf, const uint64_t *bits) {
+    uint64_t k = bf->num_partitions;
+    if (bf->flags & BLOOM_COUNTING) {
+        uint64_t i = 0;
+        while (i < k && bloom_get_bit(bf, bits[i])) {
+            i++;
+        }
+        if (i == k) {
+            return 0;
+        }
+    }
+    int fresh = 0;
+    for (uint64_t i = 0; i < k; i++) {
+        if (bloom_set_bit(bf, bits[i])) {
+            fresh = 1;
+            if (bf->partition_fill) {
+                bloom_track_fill(bf, i, 1);
+            }
+        }
+    }
+    return fresh;
+}
+
+// bloom_index_group for keys of key_size bytes back to back. The widths with fixed entry points are hashed
+// with their length a constant; the branch on the width is the same for every key, so it is always predicted.
+static inline void bloom_index_fixed(bloom *bf, int kernel, const uint8_t *keys, uint32_t key_size, uint64_t count,
+                                     uint64_t *bits, int rw) {
+    uint64_t hashes[BLOOM_BATCH_SIZE];
+    for (uint64_t j = 0; j < count && bf->flags & BLOOM_LARGE; j++) {
+        bloom_index_wide(bf, bloom_hash_wide(bf, keys + j * key_size, key_size), bits + j * bf->num_partitions);
+    }
+    for (uint64_t j = 0; j < count && !(bf->flags & BLOOM_LARGE); j++) {
+        const uint8_t *key = keys + j * key_size;
+        hashes[j] = key_size == 4 ? bloom_hash_fixed(bf, key, 4)
+                    : key_size == 8 ? bloom_hash_fixed(bf, key, 8)
+                    : key_size == 16 ? bloom_hash_fixed(bf, key, 16)
+                    : key_size == 32 ? bloom_hash_fixed(bf, key, 32)
+                    : bloom_hash(bf, key, key_size);
+    }
+
+    if (!(bf->flags & BLOOM_LARGE)) {
+        bloom_index(bf, kernel, hashes, count, bits);
+    }
+    bloom_prefetch_bits(bf, bits, count, rw);
+}
+
+int bloom_add_batch_fixed(bloom *bf, const uint8_t *keys, uint32_t key_size, uint64_t count) {
+    if (!bf || !keys || !key_size || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    uint64_t *bits = bloom_alloc_bits(bf);
+    if (!bits) {
+        return -1;
+    }
+    int kernel = bloom_batch_kernel(bf);
+
+    for (uint64_t start = 0; start < count; start += BLOOM_BATCH_SIZE) {
+        uint64_t group = count - start < BLOOM_BATCH_SIZE ? count - start : BLOOM_BATCH_SIZE;
+        bloom_index_fixed(bf, kernel, keys + start * key_size, key_size, group, bits, 1);
+        bloom_set_group(bf, bits, group);
+    }
+
+    free(bits);
+    return 0;
+}
+
+int bloom_test_batch_fixed(bloom *bf, const uint8_t *keys, uint32_t key_size, uint64_t count, uint8_t *results) {
+    if (!bf || !keys || !key_size || !results) {
+        return -1;
+    }
+
+    uint64_t *bits = bloom_alloc_bits(bf);
+    if (!bits) {
+        return -1;
+    }
+    int kernel = bloom_batch_kernel(bf);
+
+    for (uint64_t start = 0; start < count; start += BLOOM_BATCH_SIZE) {
+        uint64_t group = count - start < BLOOM_BATCH_SIZE ? count - start : BLOOM_BATCH_SIZE;
+        bloom_index_fixed(bf, kernel, keys + start * key_size, key_size, group, bits, 0);
+        bloom_probe(bf, kernel, bits, group, results + start);
+    }
+
+    free(bits);
+    return 0;
+}
+
+// Keys of a group are set in order, so a key repeated within the batch is only new the first time
+int bloom_test_and_add_batch(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count, uint8_t *results) {
+    if (!bf || !keys || !offsets || !results || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    uint64_t *bits = bloom_alloc_bits(bf);
+    if (!bits) {
+        return -1;
+    }
+    int kernel = bloom_batch_kernel(bf);
+
+    int res = 0;
+    for (uint64_t start = 0; start < count; start += BLOOM_BATCH_SIZE) {
+        uint64_t group = count - start < BLOOM_BATCH_SIZE ? count - start : BLOOM_BATCH_SIZE;
+        if (bloom_index_group(bf, kernel, keys, offsets + start, group, bits, 1)) {
+            res = -1;
+            break;
+        }
+
+        uint64_t fresh = 0;
+        for (uint64_t j = 0; j < group; j++) {
+            results[start + j] = bloom_test_and_set_bits(bf, bits + j * bf->num_partitions);
+            fresh += results[start + j];
+        }
+        bloom_count_elems(bf, fresh);
+    }
+
+    free(bits);
+    return res;
+}
+
+typedef struct bloom_build_worker {
+    bloom *bf;
+    uint8_t *keys;
+    const uint64_t *offsets;
+    uint64_t count;
+    uint64_t *bits;
+    uint32_t *order;
+    uint64_t *bounds;
+    pthread_barrier_t *barrier;
+    pthread_mutex_t *gate;
+    uint64_t id;
+    uint64_t num_threads;
+    uint64_t region_lines;
+    int kernel;
+    uint64_t *fill;
+    uint64_t *built;
+    int *error;
+} bloom_build_worker;
+
+// How many slots ahead of the one being set a worker prefetches
+#define BLOOM_BUILD_PREFETCH 16
+
+static inline uint64_t bloom_build_region(bloom_build_worker *w, uint64_t slot) {
+    return bloom_slot_byte(w->bf, slot) / BLOOM_BLOCK_BYTES / w->region_lines;
+}
+
+// Every chunk of keys is built in two phases. First each worker indexes its share of the chunk into 'bits' and
+// sorts those slots by the region of the array they fall in, recording the bounds of each region in its row of
+// 'bounds'; then each worker sets the slots of its own region from every worker's share. Regions are whole 64 byte
+// lines of the array, so no two workers write the same byte or word and no atomics are needed.
+static void *bloom_build_run(void *arg) {
+    bloom_build_worker *w = arg;
+    pthread_mutex_lock(w->gate);
+    pthread_mutex_unlock(w->gate);
+    bloom *bf = w->bf;
+    uint64_t k = bf->num_partitions;
+    uint64_t hashes[BLOOM_BATCH_SIZE];
+    uint64_t *group_bits = bloom_alloc_bits(bf);
+    uint64_t *cursor = calloc(w->num_threads, sizeof *cursor);
+    // A worker missing either buffer leaves its share of 'bits' unwritten, so it must not sort it either
+    bool ready = group_bits && cursor;
+    if (!ready) {
+        __atomic_store_n(w->error, 1, __ATOMIC_RELAXED);
+    }
+
+    for (uint64_t chunk_start = 0; chunk_start < w->count; chunk_start += BLOOM_BUILD_CHUNK) {
+        uint64_t chunk = w->count - chunk_start < BLOOM_BUILD_CHUNK ? w->count - chunk_start : BLOOM_BUILD_CHUNK;
+        uint64_t start = chunk_start + chunk * w->id / w->num_threads;
+        uint64_t end = chunk_start + chunk * (w->id + 1) / w->num_threads;
+        for (uint64_t j = start; j < end && ready; j += BLOOM_BATCH_SIZE) {
+            uint64_t group = end - j < BLOOM_BATCH_SIZE ? end - j : BLOOM_BATCH_SIZE;
+            for (uint64_t g = 0; g < group; g++) {
+                uint64_t key_len = w->offsets[j + g + 1] - w->offsets[j + g];
+                if (!key_len) {
+                    __atomic_store_n(w->error, 1, __ATOMIC_RELAXED);
+                }
+                if (bf->flags & BLOOM_LARGE) {
+                    bloom_index_wide(bf, bloom_hash_wide(bf, w->keys + w->offsets[j + g], key_len), group_bits + g * k);
+                } else {
+                    hashes[g] = bloom_hash(bf, w->keys + w->offsets[j + g], key_len);
+                }
+            }
+            // The index kernels may write past the group, so they fill a private buffer
+            if (!(bf->flags & BLOOM_LARGE)) {
+                bloom_index(bf, w->kernel, hashes, group, group_bits);
+            }
+            memcpy(w->bits + (j - chunk_start) * k, group_bits, group * k * sizeof(uint64_t));
+        }
+
+        // Counting sort of this worker's slots by region, keeping their order within a region
+        uint64_t *bounds = w->bounds + w->id * (w->num_threads + 1);
+        uint64_t first = (start - chunk_start) * k;
+        uint64_t last = (end - chunk_start) * k;
+        memset(bounds, 0, (w->num_threads + 1) * sizeof *bounds);
+        for (uint64_t i = first; i < last && ready; i++) {
+            bounds[bloom_build_region(w, w->bits[i]) + 1]++;
+        }
+        bounds[0] = first;
+        for (uint64_t r = 0; r < w->num_threads && ready; r++) {
+            bounds[r + 1] += bounds[r];
+            cursor[r] = bounds[r];
+        }
+        for (uint64_t i = first; i < last && ready; i++) {
+            w->order[cursor[bloom_build_region(w, w->bits[i])]++] = (uint32_t) i;
+        }
+        pthread_barrier_wait(w->barrier);
+        if (__atomic_load_n(w->error, __ATOMIC_RELAXED)) {
+            break;
+        }
+
+        for (uint64_t t = 0; t < w->num_threads; t++) {
+            const uint64_t *from = w->bounds + t * (w->num_threads + 1);
+            for (uint64_t j = from[w->id]; j < from[w->id + 1]; j++) {
+                if (j + BLOOM_BUILD_PREFETCH < from[w->id + 1]) {
+                    uint64_t ahead = w->bits[w->order[j + BLOOM_BUILD_PREFETCH]];
+                    __builtin_prefetch(bf->bloom_ptr + bloom_slot_byte(bf, ahead), 1);
+                }
+                uint32_t i = w->order[j];
+                if (bloom_set_bit(bf, w->bits[i]) && w->fill) {
+                    w->fill[i % k]++;
+                }
+            }
+        }
+        pthread_barrier_wait(w->barrier);
+        if (!w->id) {
+            *w->built = chunk_start + chunk;
+        }
+    }
+
+    free(group_bits);
+    free(cursor);
+    return NULL;
+}
+
+int bloom_build_parallel(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count, uint32_t threads) {
+    if (!bf || !keys || !offsets || bloom_read_only(bf)) {
+        return -1;
+    }
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+    // Every worker needs a region of at least one cache line
+    uint64_t lines = (bf->size + BLOOM_BLOCK_BYTES - 1) / BLOOM_BLOCK_BYTES;
+    threads = threads > lines ? (uint32_t) lines : threads;
+    if (threads <= 1) {
+        return bloom_add_batch(bf, keys, offsets, count);
+    }
+
+    uint64_t k = bf->num_partitions;
+    uint64_t chunk = count < BLOOM_BUILD_CHUNK ? count : BLOOM_BUILD_CHUNK;
+    bloom_build_worker *workers = calloc(threads, sizeof *workers);
+    pthread_t *ids = calloc(threads, sizeof *ids);
+    uint64_t *bits = malloc((chunk * k + 1) * sizeof *bits);
+    uint32_t *order = malloc((chunk * k + 1) * sizeof *order);
+    uint64_t *bounds = malloc((uint64_t) threads * (threads + 1) * sizeof *bounds);
+    uint64_t *fill = bf->partition_fill ? calloc(threads * k, sizeof *fill) : NULL;
+    if (!workers || !ids || !bits || !order || !bounds || (bf->partition_fill && !fill)) {
+        free(workers);
+        free(ids);
+        free(bits);
+        free(order);
+        free(bounds);
+        free(fill);
+        return -1;
+    }
+
+    int kernel = bloom_batch_kernel(bf);
+    // Workers wait on the gate until every thread that could be started knows the final thread count, its
+    // region and the barrier; threads that fail to start just leave the others with larger regions
+    pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&gate);
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < threads; i++) {
+        workers[started].gate = &gate;
+        started += !pthread_create(&ids[started], NULL, bloom_build_run, &workers[started]);
+    }
+
+    pthread_barrier_t barrier;
+    bool ready = started && !pthread_barrier_init(&barrier, NULL, started);
+    int error = !ready;
+    uint64_t built = 0;
+    for (uint32_t i = 0; i < started; i++) {
+        bloom_build_worker *w = &workers[i];
+        w->bf = bf;
+        w->keys = keys;
+        w->offsets = offsets;
+        w->count = ready ? count : 0;
+        w->bits = bits;
+        w->order = order;
+        w->bounds = bounds;
+        w->barrier = &barrier;
+        w->id = i;
+        w->num_threads = started;
+        w->region_lines = (lines + started - 1) / started;
+        w->kernel = kernel;
+        w->fill = fill ? fill + i * k : NULL;
+        w->built = &built;
+        w->error = &error;
+    }
+    pthread_mutex_unlock(&gate);
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    if (ready) {
+        pthread_barrier_destroy(&barrier);
+    }
+
+    // Like bloom_add_batch, a failed build leaves the keys it got through (the chunks before the failing one)
+    // in the filter, so they are counted and their fill merged either way
+    for (uint64_t i = 0; fill && i < threads * k; i++) {
+        bloom_track_fill(bf, i % k, (int64_t) fill[i]);
+    }
+    bloom_count_elems(bf, built);
+    free(workers);
+    free(ids);
+    free(bits);
+    free(order);
+    free(bounds);
+    free(fill);
+    return error ? -1 : 0;
+}
+
+bloom *bloom_alloc(double p, uint64_t n, uint8_t *bloom_data, uint64_t prefix_len) {
+    return bloom_alloc_ex(p, n, bloom_data, prefix_len, 0);
+}
+
+bloom *bloom_alloc_ex(double p, uint64_t n, uint8_t *bloom_data, uint64_t prefix_len, uint32_t flags) {
+    bloom *bf = calloc(1, sizeof *bf);
+
+    if (bloom_init_ex(bf, p, n, bloom_data, prefix_len, flags)) {
+        bloom_free(bf);
+        bf = NULL;
+    }
+
+    return bf;
+}
+
+int bloom_init(bloom *bf, double p, uint64_t n, uint8_t *bloom_data, uint64_t prefix_len) {
+    return bloom_init_ex(bf, p, n, bloom_data, prefix_len, 0);
+}
+
+// Counting filters update their counters with plain read-modify-writes and are not laid out in blocks, nor
+// are large filters, whose partitions are far larger than a block
+static inline bool bloom_valid_flags(uint32_t flags) {
+    uint32_t known = BLOOM_BLOCKED | BLOOM_CONCURRENT | BLOOM_CACHE_ALIGNED | BLOOM_COUNTING | BLOOM_TRACK_FILL
+                     | BLOOM_HUGE_PAGES | BLOOM_LARGE | BLOOM_ALIGNED;
+    if (flags & ~known) {
+        return false;
+    }
+    return !(flags & BLOOM_COUNTING && flags & (BLOOM_BLOCKED | BLOOM_CONCURRENT))
+           && !(flags & (BLOOM_LARGE | BLOOM_ALIGNED) && flags & BLOOM_BLOCKED)
+           && (flags & BLOOM_ALIGNED) != BLOOM_ALIGNED;
+}
+
+// Sizes the filter and lays out its partitions, leaving the array to be allocated or attached
+static int bloom_plan(bloom *bf, double p, uint64_t n, uint64_t prefix_len, uint32_t flags) {
+    if (!bf || p <= 0.0 || !(p < 1.0) || n <= 0 || !bloom_valid_flags(flags)) {
+        return -1;
+    }
+    *bf = (bloom) {0};
+    bloom_init_hash(bf, BLOOM_HASH_DEFAULT, 0);
+    // ln (1 / (2^(ln 2))
+    static double ln1_div_2topowof_ln2 = -0.48045301391820149916611626395024359226226806640625;
+    double target_bits = ceil((n * log(p)) / ln1_div_2topowof_ln2);
+    // The size is carried as an integer from here on, so it must fit one with room for the partition sums
+    if (!(target_bits < 0x1p62)) {
+        return -1;
+    }
+    uint64_t target_size = (uint64_t) target_bits;
+    uint64_t num_partitions = (uint64_t) ceil(log(2.0) * target_bits / n);
+
+    prime_table primes = {0};
+    uint64_t first_prime = 0;
+    uint64_t num_blocks = 0;
+    if (flags & BLOOM_BLOCKED) {
+        if (generate_primes(&primes, BLOOM_BLOCK_BITS + 1)) {
+            return -1;
+        }
+        if (bloom_calc_blocks((double) n, p, &primes, &num_partitions, &first_prime, &num_blocks)) {
+            free(primes.primes);
+            return -1;
+        }
+    }
+
+    if (bloom_alloc_partitions(bf, num_partitions)) {
+        free(primes.primes);
+        return -1;
+    }
+
+    bf->prefix_len = prefix_len;
+    bf->false_pos_rate = p;
+    bf->flags = flags;
+
+    bf->capacity = n;
+    bf->num_elems = 0;
+
+    int res;
+    if (flags & BLOOM_BLOCKED) {
+        res = bloom_layout_blocks(bf, &primes, first_prime, num_blocks);
+    } else {
+        res = bloom_calc_partitions(bf, target_size, num_partitions);
+    }
+    free(primes.primes);
+    return res;
+}
+
+int bloom_init_ex(bloom *bf, double p, uint64_t n, uint8_t *bloom_data, uint64_t prefix_len, uint32_t flags) {
+    if (bloom_plan(bf, p, n, prefix_len, flags)) {
+        return -1;
+    }
+
+    // A headerless array does not say which hash built it, so it is taken to be the original XXH64, which a
+    // build pinned to another hash cannot probe
+    if (bloom_data && bloom_init_hash(bf, BLOOM_HASH_XXH64, 0)) {
+        return -1;
+    }
+    bf->base_ptr = bloom_data;
+    if (bloom_alloc_array(bf)) {
+        return -1;
+    }
+    return bloom_init_lanes(bf);
+}
+
+void bloom_print(bloom *bf) {
+    printf("Bloomfilter stats\n--------\n");
+    printf("Size: %ld bytes (% ld bits)\n", bf->size, bf->size * 8);
+    printf("Capacity: %ld (%ld used)\n", bf->capacity, bloom_get_num_elems(bf));
+    printf("Number of partitions: %ld\n", bf->num_partitions);
+    if (bf->flags & BLOOM_BLOCKED) {
+        printf("Layout: blocked (%ld blocks of %d bits)\n", bf->num_blocks, BLOOM_BLOCK_BITS);
+    }
+    if (bf->flags & BLOOM_ALIGNED) {
+        printf("Layout: partitions aligned to %s\n", bf->flags & BLOOM_ALIGN_LINES ? "cache lines" : "64 bit words");
+    }
+    if (bf->flags & BLOOM_LARGE) {
+        printf("Hashing: 128 bit (large)\n");
+    }
+    if (bf->flags & BLOOM_HUGE_PAGES) {
+        static const char *pages[] = {"4KB", "transparent huge", "2MB", "1GB"};
+        printf("Pages: %s\n", pages[bf->pages]);
+    }
+    printf("Target false positive rate: %.10f\n", bf->false_pos_rate);
+    printf("Hash: %s (seed %#lx)\n", bf->hash_id == BLOOM_HASH_XXH64 ? "xxh64" : bf->hash_id == BLOOM_HASH_XXH3 ? "xxh3"
+           : "custom", bf->hash_seed);
+    printf("Partition sizes (bits): ");
+    for (int i = 0; i < bf->num_partitions - 1; i++) {
+        printf("%ld, ", bf->partition_lengths[i]);
+    }
+    printf("%ld\n", bf->partition_lengths[bf->num_partitions - 1]);
+}
+
+void bloom_clear(bloom *bf) {
+    if (!bf)
+        return;
+
+    free(bf->partition_ptrs);
+    free(bf->partition_lengths);
+    free(bf->partition_fastmod);
+    free(bf->partition_offsets);
+    bloom_free_lanes(bf->lanes);
+    free(bf->elem_stripes);
+    free(bf->partition_fill);
+
+    if (bf->map_len) {
+        munmap(bf->base_ptr, bf->map_len);
+    } else if (bf->alloced) {
+        free(bf->base_ptr);
+    }
+
+    bf->base_ptr = NULL;
+    bf->bloom_ptr = NULL;
+    bf->size = 0;
+    bf->total_size = 0;
+    bf->num_partitions = 0;
+    bf->prefix_len = 0;
+    bf->false_pos_rate = 0.0;
+    bf->partition_ptrs = NULL;
+    bf->partition_lengths = NULL;
+    bf->partition_fastmod = NULL;
+    bf->partition_offsets = NULL;
+    bf->lanes = NULL;
+    bf->elem_stripes = NULL;
+    bf->partition_fill = NULL;
+    bf->fill_pending = false;
+    bf->num_blocks = 0;
+    bf->flags = 0;
+    bf->capacity = 0;
+    bf->num_elems = 0;
+    bf->map_len = 0;
+    bf->map_writable = false;
+    bf->pages = BLOOM_PAGES_DEFAULT;
+}
+
+void bloom_free(bloom *bf) {
+    bloom_clear(bf);
+    free(bf);
+}
+
+uint8_t *bloom_get_filter(bloom *bf) {
+    return bf->bloom_ptr;
+}
+uint8_t *bloom_get_prefix(bloom *bf) {
+    return bf->base_ptr;
+}
+
+static inline uint64_t bloom_header_checksum(const bloom_header *header, const uint8_t *lengths, uint64_t k) {
+    bloom_header copy = *header;
+    copy.header_checksum = 0;
+    return XXH64(lengths, k * sizeof(uint64_t), XXH64(&copy, sizeof copy, 0));
+}
+
+static inline int bloom_write_header(bloom *bf, bool checksum_data) {
+    if (!bf || !bf->base_ptr || bf->prefix_len < BLOOM_HEADER_LEN(bf->num_partitions) || bloom_read_only(bf)) {
+        return -1;
+    }
+
+    bloom_header header = {
+        .magic = BLOOM_MAGIC,
+        .version = BLOOM_VERSION,
+        .endianness = BLOOM_ENDIAN_MARK,
+        .flags = bf->flags,
+        .hash_id = bf->hash_id,
+        .hash_seed = bf->hash_seed,
+        .false_pos_rate = bf->false_pos_rate,
+        .capacity = bf->capacity,
+        .num_elems = bloom_get_num_elems(bf),
+        .num_partitions = bf->num_partitions,
+        .num_blocks = bf->num_blocks,
+        .size = bf->size,
+        .prefix_len = bf->prefix_len,
+        .data_checksum = checksum_data ? XXH64(bf->bloom_ptr, bf->size, 0) : 0,
+    };
+    uint8_t *lengths = bf->base_ptr + sizeof header;
+    memcpy(lengths, bf->partition_lengths, bf->num_partitions * sizeof(uint64_t));
+    header.header_checksum = bloom_header_checksum(&header, lengths, bf->num_partitions);
+    memcpy(bf->base_ptr, &header, sizeof header);
+    return 0;
+}
+
+int bloom_serialize(bloom *bf) {
+    return bloom_write_header(bf, true);
+}
+
+int bloom_init_layout(bloom *bf, const bloom_header *layout, const uint64_t *lengths, uint8_t *data,
+                      uint64_t data_len) {
+    if (!bf || !layout || !lengths || !layout->num_partitions
+        || !bloom_valid_flags(layout->flags)) {
+        return -1;
+    }
+
+    *bf = (bloom) {0};
+    if (bloom_init_hash(bf, layout->hash_id, layout->hash_seed)
+        || bloom_alloc_partitions(bf, layout->num_partitions)) {
+        bloom_clear(bf);
+        return -1;
+    }
+
+    uint64_t block_bits = 0;
+    for (uint64_t i = 0; i < layout->num_partitions; i++) {
+        bf->partition_lengths[i] = lengths[i];
+        block_bits += lengths[i];
+        if (lengths[i] < 2) {
+            bloom_clear(bf);
+            return -1;
+        }
+    }
+
+    bf->prefix_len = layout->prefix_len;
+    bf->false_pos_rate = layout->false_pos_rate;
+    bf->capacity = layout->capacity;
+    bf->num_blocks = layout->num_blocks;
+    bf->flags = layout->flags;
+
+    if ((bf->flags & BLOOM_BLOCKED && (block_bits > BLOOM_BLOCK_BITS || !bf->num_blocks))
+        || bloom_layout_partitions(bf) || (layout->size && bf->size != layout->size)
+        || (data && (data_len < bf->prefix_len || data_len - bf->prefix_len < bf->size))) {
+        bloom_clear(bf);
+        return -1;
+    }
+
+    bf->base_ptr = data;
+    if (bloom_alloc_array(bf)) {
+        bloom_clear(bf);
+        return -1;
+    }
+
+    if (bf->flags & BLOOM_CONCURRENT) {
+        bf->elem_stripes[0] = layout->num_elems;
+    } else {
+        bf->num_elems = layout->num_elems;
+    }
+    return bloom_init_lanes(bf);
+}
+
+static inline uint64_t bloom_read_u64(const uint8_t *p, bool swap) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return swap ? __builtin_bswap64(v) : v;
+}
+
+// Converts a header written on a machine of the other byte order
+static inline void bloom_swap_header(bloom_header *header) {
+    header->magic = __builtin_bswap32(header->magic);
+    header->version = __builtin_bswap16(header->version);
+    header->endianness = __builtin_bswap16(header->endianness);
+    header->flags = __builtin_bswap32(header->flags);
+    header->hash_id = __builtin_bswap32(header->hash_id);
+    uint64_t *words = &header->hash_seed;
+    for (uint64_t i = 0; i < (sizeof *header - offsetof(bloom_header, hash_seed)) / sizeof(uint64_t); i++) {
+        words[i] = __builtin_bswap64(words[i]);
+    }
+}
+
+int bloom_deserialize(bloom *bf, uint8_t *buf, uint64_t buf_len, bool verify) {
+    if (!bf || !buf || buf_len < sizeof(bloom_header)) {
+        return -1;
+    }
+
+    bloom_header header;
+    memcpy(&header, buf, sizeof header);
+    bool swap = header.endianness != BLOOM_ENDIAN_MARK;
+    if (swap) {
+        bloom_swap_header(&header);
+    }
+    if (header.magic != BLOOM_MAGIC || header.version != BLOOM_VERSION || header.endianness != BLOOM_ENDIAN_MARK
+        || !bloom_valid_flags(header.flags) || !header.num_partitions
+        || header.num_partitions > (buf_len - sizeof header) / sizeof(uint64_t)
+        || header.prefix_len < BLOOM_HEADER_LEN(header.num_partitions) || header.prefix_len > buf_len
+        || header.size > buf_len - header.prefix_len) {
+        return -1;
+    }
+
+    // The checksum covers the fields as written, so it is computed before swapping them
+    bloom_header raw;
+    memcpy(&raw, buf, sizeof raw);
+    uint64_t checksum = bloom_header_checksum(&raw, buf + sizeof header, header.num_partitions);
+    if (checksum != header.header_checksum) {
+        return -1;
+    }
+    if (verify && header.data_checksum && XXH64(buf + header.prefix_len, header.size, 0) != header.data_checksum) {
+        return -1;
+    }
+
+    const uint64_t *lengths = (const uint64_t *) (buf + sizeof header);
+    uint64_t *swapped = NULL;
+    if (swap) {
+        swapped = malloc(header.num_partitions * sizeof *swapped);
+        if (!swapped) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < header.num_partitions; i++) {
+            swapped[i] = bloom_read_u64(buf + sizeof header + i * sizeof(uint64_t), true);
+        }
+        lengths = swapped;
+    }
+
+    int res = bloom_init_layout(bf, &header, lengths, buf, buf_len);
+    free(swapped);
+    return res;
+}
+
+bloom *bloom_open_mmap(const char *path, uint32_t map_flags) {
+    bool writable = map_flags & BLOOM_MAP_WRITE;
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    uint8_t *map = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    // Probes hit random pages, so readahead around them would only waste I/O
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    bloom *bf = calloc(1, sizeof *bf);
+    if (!bf || bloom_deserialize(bf, map, st.st_size, false)) {
+        free(bf);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    bf->map_len = st.st_size;
+    bf->map_writable = writable;
+    return bf;
+}
+
+bloom *bloom_create_mmap(const char *path, double p, uint64_t n, uint32_t flags) {
+    bloom *bf = calloc(1, sizeof *bf);
+    if (!bf || bloom_plan(bf, p, n, BLOOM_HEADER_MAX_LEN, flags)) {
+        bloom_free(bf);
+        return NULL;
+    }
+
+    // The file is extended without writing it, so the untouched parts of the array stay holes
+    uint64_t map_len = bf->size + bf->prefix_len;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint8_t *map = MAP_FAILED;
+    if (fd >= 0 && !ftruncate(fd, map_len)) {
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        bloom_free(bf);
+        return NULL;
+    }
+    madvise(map, map_len, MADV_RANDOM);
+
+    bf->base_ptr = map;
+    bf->map_len = map_len;
+    bf->map_writable = true;
+    if (bloom_alloc_array(bf) || bloom_init_lanes(bf) || bloom_write_header(bf, false)) {
+        bloom_free(bf);
+        return NULL;
+    }
+    return bf;
+}
+
+// The data checksum would cost a pass over the whole array on every sync, so the header is written without
+// one and a verifying reader skips the data check
+int bloom_sync(bloom *bf) {
+    if (!bf || !bf->map_len || !bf->map_writable || bloom_write_header(bf, false)) {
+        return -1;
+    }
+    return msync(bf->base_ptr, bf->map_len, MS_SYNC);
+}
+
+
+// Shards are picked from the high bits of the remixed hash, as the high bits of the hash itself already
+// select the block within a blocked shard
+static inline uint64_t bloom_mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Keys are routed by the low 64 bits of the hash they are probed with, the 128 bit one in BLOOM_LARGE filters, so
+// bloom_sharded_index, add and test always agree
+static inline uint64_t bloom_sharded_shard(bloom_sharded *bs, bloom_wide_hash hash) {
+    return (uint64_t) (((unsigned __int128) bloom_mix64((uint64_t) hash) * bs->num_shards) >> 64);
+}
+
+static inline bloom *bloom_sharded_route(bloom_sharded *bs, bloom_wide_hash hash) {
+    return &bs->shards[bloom_sharded_shard(bs, hash)].bf;
+}
+
+bloom_sharded *bloom_sharded_alloc(double p, uint64_t n, uint64_t num_shards, uint32_t flags) {
+    bloom_sharded *bs = calloc(1, sizeof *bs);
+
+    if (bloom_sharded_init(bs, p, n, num_shards, flags)) {
+        bloom_sharded_free(bs);
+        bs = NULL;
+    }
+
+    return bs;
+}
+
+int bloom_sharded_init(bloom_sharded *bs, double p, uint64_t n, uint64_t num_shards, uint32_t flags) {
+    if (!bs || !num_shards || n < num_shards) {
+        return -1;
+    }
+
+    bs->shards = aligned_alloc(BLOOM_BLOCK_BYTES, num_shards * sizeof *bs->shards);
+    if (!bs->shards) {
+        return -1;
+    }
+    memset(bs->shards, 0, num_shards * sizeof *bs->shards);
+    bs->num_shards = num_shards;
+
+    uint64_t shard_n = (n + num_shards - 1) / num_shards;
+    for (uint64_t i = 0; i < num_shards; i++) {
+        if (bloom_init_ex(&bs->shards[i].bf, p, shard_n, NULL, 0, flags | BLOOM_CACHE_ALIGNED)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void bloom_sharded_clear(bloom_sharded *bs) {
+    if (!bs) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < bs->num_shards; i++) {
+        bloom_clear(&bs->shards[i].bf);
+    }
+    free(bs->shards);
+    bs->shards = NULL;
+    bs->num_shards = 0;
+}
+
+void bloom_sharded_free(bloom_sharded *bs) {
+    bloom_sharded_clear(bs);
+    free(bs);
+}
+
+int bloom_sharded_use_hash(bloom_sharded *bs, uint32_t hash_id, uint64_t seed) {
+    if (!bs || !bs->num_shards || bloom_sharded_get_num_elems(bs)) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < bs->num_shards; i++) {
+        if (bloom_use_hash(&bs->shards[i].bf, hash_id, seed)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t bloom_sharded_index(bloom_sharded *bs, uint8_t *data, uint64_t data_len) {
+    if (!bs || !data || !data_len) {
+        return 0;
+    }
+    return bloom_sharded_shard(bs, bloom_hash_wide(&bs->shards[0].bf, data, data_len));
+}
+
+int bloom_sharded_add(bloom_sharded *bs, uint8_t *data, uint64_t data_len) {
+    if (!bs || !data || !data_len) {
+        return -1;
+    }
+
+    bloom_wide_hash hash = bloom_hash_wide(&bs->shards[0].bf, data, data_len);
+    bloom *bf = bloom_sharded_route(bs, hash);
+    bloom_set_hash(bf, hash);
+    bloom_count_elems(bf, 1);
+    return 0;
+}
+
+int bloom_sharded_test(bloom_sharded *bs, uint8_t *data, uint64_t data_len) {
+    if (!bs || !data || !data_len) {
+        return -1;
+    }
+
+    bloom_wide_hash hash = bloom_hash_wide(&bs->shards[0].bf, data, data_len);
+    return bloom_check_hash(bloom_sharded_route(bs, hash), hash);
+}
+
+uint64_t bloom_sharded_get_num_elems(bloom_sharded *bs) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; bs && i < bs->num_shards; i++) {
+        sum += bloom_get_num_elems(&bs->shards[i].bf);
+    }
+    return sum;
+}
+
+// The filter is only as good as its fullest shard, so this is the smallest capacity left in any shard
+uint64_t bloom_sharded_remaining_capacity(bloom_sharded *bs) {
+    if (!bs || !bs->num_shards) {
+        return 0;
+    }
+
+    uint64_t min = UINT64_MAX;
+    for (uint64_t i = 0; i < bs->num_shards; i++) {
+        uint64_t remaining = bloom_remaining_capacity(&bs->shards[i].bf);
+        min = remaining < min ? remaining : min;
+    }
+    return min;
+}
+
+void bloom_sharded_print(bloom_sharded *bs) {
+    uint64_t size = 0;
+    uint64_t capacity = 0;
+    for (uint64_t i = 0; i < bs->num_shards; i++) {
+        size += bs->shards[i].bf.size;
+        capacity += bs->shards[i].bf.capacity;
+    }
+
+    printf("Sharded bloomfilter stats\n--------\n");
+    printf("Shards: %ld\n", bs->num_shards);
+    printf("Size: %ld bytes (% ld bits)\n", size, size * 8);
+    printf("Capacity: %ld (%ld used)\n", capacity, bloom_sharded_get_num_elems(bs));
+    printf("Shard fill (used/capacity): ");
+    for (uint64_t i = 0; i < bs->num_shards; i++) {
+        bloom *bf = &bs->shards[i].bf;
+        printf("%ld/%ld%s", bloom_get_num_elems(bf), bf->capacity, i + 1 < bs->num_shards ? ", " : "\n");
+    }
+}
+
+
+bloom_scalable *bloom_scalable_alloc(double p, uint64_t n, uint32_t flags) {
+    bloom_scalable *bs = calloc(1, sizeof *bs);
+
+    if (bloom_scalable_init(bs, p, n, flags)) {
+        bloom_scalable_free(bs);
+        bs = NULL;
+    }
+
+    return bs;
+}
+
+// Appends the next filter of the series. Filter i holds n * GROWTH^i keys at p * (1 - TIGHTENING) *
+// TIGHTENING^i, and the rates sum to less than p however many filters are added.
+static inline int bloom_scalable_grow(bloom_scalable *bs) {
+    bloom *filters = realloc(bs->filters, (bs->num_filters + 1) * sizeof *filters);
+    if (!filters) {
+        return -1;
+    }
+    bs->filters = filters;
+
+    uint64_t i = bs->num_filters;
+    double p = bs->false_pos_rate * (1 - BLOOM_SCALABLE_TIGHTENING) * pow(BLOOM_SCALABLE_TIGHTENING, (double) i);
+    double n = bs->initial_capacity * pow(BLOOM_SCALABLE_GROWTH, (double) i);
+    // Every filter shares the hash of the first, so a key is hashed once for all of them
+    if (bloom_init_ex(&bs->filters[i], p, (uint64_t) n, NULL, 0, bs->flags)
+        || (i && bloom_init_hash(&bs->filters[i], bs->filters[0].hash_id, bs->filters[0].hash_seed))) {
+        bloom_clear(&bs->filters[i]);
+        return -1;
+    }
+    bs->num_filters++;
+    return 0;
+}
+
+int bloom_scalable_init(bloom_scalable *bs, double p, uint64_t n, uint32_t flags) {
+    if (!bs || p <= 0.0 || p >= 1.0 || !n || flags & BLOOM_CONCURRENT) {
+        return -1;
+    }
+
+    bs->filters = NULL;
+    bs->num_filters = 0;
+    bs->false_pos_rate = p;
+    bs->initial_capacity = n;
+    bs->flags = flags;
+    return bloom_scalable_grow(bs);
+}
+
+void bloom_scalable_clear(bloom_scalable *bs) {
+    if (!bs) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < bs->num_filters; i++) {
+        bloom_clear(&bs->filters[i]);
+    }
+    free(bs->filters);
+    bs->filters = NULL;
+    bs->num_filters = 0;
+    bs->false_pos_rate = 0.0;
+    bs->initial_capacity = 0;
+    bs->flags = 0;
+}
+
+void bloom_scalable_free(bloom_scalable *bs) {
+    bloom_scalable_clear(bs);
+    free(bs);
+}
+
+int bloom_scalable_use_hash(bloom_scalable *bs, uint32_t hash_id, uint64_t seed) {
+    if (!bs || !bs->num_filters || bloom_scalable_get_num_elems(bs)) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < bs->num_filters; i++) {
+        if (bloom_use_hash(&bs->filters[i], hash_id, seed)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int bloom_scalable_add(bloom_scalable *bs, uint8_t *data, uint64_t data_len) {
+    if (!bs || !bs->num_filters || !data || !data_len) {
+        return -1;
+    }
+
+    if (!bloom_remaining_capacity(&bs->filters[bs->num_filters - 1]) && bloom_scalable_grow(bs)) {
+        return -1;
+    }
+    bloom *bf = &bs->filters[bs->num_filters - 1];
+    bloom_set_hash(bf, bloom_hash_wide(&bs->filters[0], data, data_len));
+    bloom_count_elems(bf, 1);
+    return 0;
+}
+
+// The newest filter is the largest and holds the most recent keys, so it is checked first
+int bloom_scalable_test(bloom_scalable *bs, uint8_t *data, uint64_t data_len) {
+    if (!bs || !data || !data_len) {
+        return -1;
+    }
+
+    if (!bs->num_filters) {
+        return 1;
+    }
+    bloom_wide_hash hash = bloom_hash_wide(&bs->filters[0], data, data_len);
+    for (uint64_t i = bs->num_filters; i > 0; i--) {
+        if (!bloom_check_hash(&bs->filters[i - 1], hash)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+uint64_t bloom_scalable_get_num_elems(bloom_scalable *bs) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; bs && i < bs->num_filters; i++) {
+        sum += bloom_get_num_elems(&bs->filters[i]);
+    }
+    return sum;
+}
+
+void bloom_scalable_print(bloom_scalable *bs) {
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < bs->num_filters; i++) {
+        size += bs->filters[i].size;
+    }
+
+    printf("Scalable bloomfilter stats\n--------\n");
+    printf("Filters: %ld\n", bs->num_filters);
+    printf("Size: %ld bytes (% ld bits)\n", size, size * 8);
+    printf("Elements: %ld\n", bloom_scalable_get_num_elems(bs));
+    printf("Target false positive rate: %.10f\n", bs->false_pos_rate);
+    printf("Filter fill (used/capacity, p): ");
+    for (uint64_t i = 0; i < bs->num_filters; i++) {
+        bloom *bf = &bs->filters[i];
+        printf("%ld/%ld %.2e%s", bloom_get_num_elems(bf), bf->capacity, bf->false_pos_rate,
+               i + 1 < bs->num_filters ? ", " : "\n");
+    }
+}
+
+
+// Ids in a sysfs list such as "0-1,3"
+static int bloom_read_id_list(const char *path, uint64_t *ids, uint64_t max_ids, uint64_t *num_ids) {
+    char buf[4096] = {0};
+    int fd = open(path, O_RDONLY);
+    ssize_t len = fd >= 0 ? read(fd, buf, sizeof buf - 1) : -1;
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    *num_ids = 0;
+    char *p = buf;
+    while (len > 0 && *p >= '0' && *p <= '9') {
+        uint64_t lo = strtoull(p, &p, 10), hi = lo;
+        if (*p == '-') {
+            hi = strtoull(p + 1, &p, 10);
+        }
+        for (uint64_t id = lo; id <= hi; id++) {
+            if (*num_ids == max_ids) {
+                return -1;
+            }
+            ids[(*num_ids)++] = id;
+        }
+        p += *p == ',';
+    }
+    return 0;
+}
+
+// Node ids listed in /sys/devices/system/node/online. Without NUMA support there is one node, 0.
+static int bloom_online_nodes(uint64_t *nodes, uint64_t max_nodes, uint64_t *num_nodes) {
+    if (bloom_read_id_list("/sys/devices/system/node/online", nodes, max_nodes, num_nodes)) {
+        return -1;
+    }
+    if (!*num_nodes) {
+        nodes[(*num_nodes)++] = 0;
+    }
+    return 0;
+}
+
+// Restricts the calling thread to the CPUs of 'node'
+static int bloom_pin_to_node(uint64_t node) {
+    char path[64];
+    uint64_t cpus[CPU_SETSIZE];
+    uint64_t num_cpus;
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%lu/cpulist", node);
+    if (bloom_read_id_list(path, cpus, CPU_SETSIZE, &num_cpus) || !num_cpus) {
+        return -1;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (uint64_t i = 0; i < num_cpus; i++) {
+        if (cpus[i] < CPU_SETSIZE) {
+            CPU_SET(cpus[i], &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) ? -1 : 0;
+}
+
+// A filter whose array is mapped for 'node'. 'bound' is set when mbind places its pages on the node.
+static int bloom_init_on_node(bloom *bf, double p, uint64_t n, uint32_t flags, uint64_t node, bool *bound) {
+    if (bloom_plan(bf, p, n, 0, flags)) {
+        return -1;
+    }
+
+    bf->total_size = bf->size;
+    int res = bloom_map_array(bf, (int64_t) node);
+    if (res < 0 || bloom_alloc_array(bf)) {
+        return -1;
+    }
+    *bound = !res;
+    return bloom_init_lanes(bf);
+}
+
+typedef struct bloom_prefault_arg {
+  bloom *bf;
+  uint64_t node;
+  bool bound;
+  bool local;
+} bloom_prefault_arg;
+
+// Zeroes a replica's pages, faulting them in. Pages mbind did not bind are allocated on the node of the CPU
+// touching them, so the thread first moves onto its node's CPUs.
+static void *bloom_prefault(void *arg) {
+    bloom_prefault_arg *fault = arg;
+    fault->local = fault->bound || !bloom_pin_to_node(fault->node);
+    memset(fault->bf->bloom_ptr, 0, fault->bf->size);
+    return NULL;
+}
+
+bloom_replicated *bloom_replicated_alloc(double p, uint64_t n, uint32_t flags) {
+    bloom_replicated *br = calloc(1, sizeof *br);
+
+    if (bloom_replicated_init(br, p, n, flags)) {
+        bloom_replicated_free(br);
+        br = NULL;
+    }
+
+    return br;
+}
+
+int bloom_replicated_init(bloom_replicated *br, double p, uint64_t n, uint32_t flags) {
+    if (!br || flags & BLOOM_COUNTING) {
+        return -1;
+    }
+    *br = (bloom_replicated) {0};
+
+    uint64_t nodes[1024];
+    uint64_t num_nodes;
+    if (bloom_online_nodes(nodes, sizeof nodes / sizeof *nodes, &num_nodes)) {
+        return -1;
+    }
+    br->replicas = calloc(num_nodes, sizeof *br->replicas);
+    br->num_nodes = nodes[num_nodes - 1] + 1;
+    br->node_replica = calloc(br->num_nodes, sizeof *br->node_replica);
+    if (!br->replicas || !br->node_replica) {
+        return -1;
+    }
+
+    bloom_prefault_arg *faults = calloc(num_nodes, sizeof *faults);
+    if (!faults) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < num_nodes; i++) {
+        br->node_replica[nodes[i]] = i;
+        br->num_replicas++;
+        faults[i] = (bloom_prefault_arg) {.bf = &br->replicas[i], .node = nodes[i]};
+        if (bloom_init_on_node(&br->replicas[i], p, n, flags, nodes[i], &faults[i].bound)) {
+            free(faults);
+            return -1;
+        }
+    }
+
+    // Fault every replica in from its own thread, so zeroing the nodes' memory proceeds in parallel. The
+    // calling thread is never pinned, so a replica it has to fault in itself is local only if bound.
+    pthread_t threads[sizeof nodes / sizeof *nodes];
+    uint64_t started = 0;
+    for (; started < br->num_replicas; started++) {
+        if (pthread_create(&threads[started], NULL, bloom_prefault, &faults[started])) {
+            break;
+        }
+    }
+    br->node_local = true;
+    for (uint64_t i = 0; i < br->num_replicas; i++) {
+        if (i < started) {
+            pthread_join(threads[i], NULL);
+        } else {
+            faults[i].local = faults[i].bound;
+            memset(br->replicas[i].bloom_ptr, 0, br->replicas[i].size);
+        }
+        br->node_local &= faults[i].local;
+    }
+    free(faults);
+    return 0;
+}
+
+void bloom_replicated_clear(bloom_replicated *br) {
+    if (!br) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < br->num_replicas; i++) {
+        bloom_clear(&br->replicas[i]);
+    }
+    free(br->replicas);
+    free(br->node_replica);
+    *br = (bloom_replicated) {0};
+}
+
+void bloom_replicated_free(bloom_replicated *br) {
+    bloom_replicated_clear(br);
+    free(br);
+}
+
+int bloom_replicated_add(bloom_replicated *br, uint8_t *data, uint64_t data_len) {
+    if (!br || !br->num_replicas) {
+        return -1;
+    }
+    return bloom_add(&br->replicas[0], data, data_len);
+}
+
+int bloom_replicated_publish(bloom_replicated *br) {
+    if (!br || !br->num_replicas) {
+        return -1;
+    }
+
+    bloom *primary = &br->replicas[0];
+    uint64_t num_elems = bloom_get_num_elems(primary);
+    for (uint64_t i = 1; i < br->num_replicas; i++) {
+        bloom *replica = &br->replicas[i];
+        memcpy(replica->bloom_ptr, primary->bloom_ptr, primary->size);
+        if (primary->partition_fill) {
+            memcpy(replica->partition_fill, primary->partition_fill, primary->num_partitions * sizeof(uint64_t));
+        }
+        bloom_set_num_elems(replica, num_elems);
+    }
+    return 0;
+}
+
+// The node is looked up again every 256 calls, so a thread that migrates soon reads its new local replica
+static _Thread_local uint32_t bloom_thread_node;
+static _Thread_local uint32_t bloom_thread_node_age;
+
+bloom *bloom_replicated_local(bloom_replicated *br) {
+    if (!br || !br->num_replicas) {
+        return NULL;
+    }
+    if (br->num_replicas == 1) {
+        return &br->replicas[0];
+    }
+
+    if (!bloom_thread_node_age--) {
+        unsigned int cpu, node;
+        bloom_thread_node = getcpu(&cpu, &node) ? 0 : node;
+        bloom_thread_node_age = 255;
+    }
+    uint64_t node = bloom_thread_node < br->num_nodes ? bloom_thread_node : 0;
+    return &br->replicas[br->node_replica[node]];
+}
+
+int bloom_replicated_test(bloom_replicated *br, uint8_t *data, uint64_t data_len) {
+    if (!br || !br->num_replicas) {
+        return -1;
+    }
+    return bloom_test(bloom_replicated_local(br), data, data_len);
+}
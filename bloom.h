@@ -8,25 +8,201 @@
 #include <stdbool.h>
 #include "xxhash.h"
 
+// Flags for bloom_init_ex/bloom_alloc_ex
+// Blocked layout: the high bits of the hash pick one cache line sized block holding all the partitions of a key
+#define BLOOM_BLOCKED 0x1U
+// Concurrent adds: bits are set with atomic ORs on aligned 64 bit words and the element count is striped
+// across threads. Tests may run alongside adds without locks.
+#define BLOOM_CONCURRENT 0x2U
+// The bit array starts on a cache line and is padded to whole lines, so it shares no line with other data
+#define BLOOM_CACHE_ALIGNED 0x4U
+// Counting filter: every slot is a saturating counter of BLOOM_COUNTER_BITS, so keys can be removed with
+// bloom_remove. Takes BLOOM_COUNTER_BITS times the memory, and cannot be combined with BLOOM_BLOCKED or
+// BLOOM_CONCURRENT.
+#define BLOOM_COUNTING 0x8U
+// Keep a count of the occupied slots of every partition up to date on add (and remove), so the distinct key
+// estimate and current false positive rate take O(k), and bloom_remaining_capacity uses the estimate
+// instead of the number of adds. Attaching an existing array with this flag counts its slots once.
+#define BLOOM_TRACK_FILL 0x10U
+// Allocate the array from huge pages: 1GB or 2MB pages reserved for hugetlbfs when there are any, otherwise
+// ordinary pages with transparent huge pages requested. Filters far larger than the TLB reach then take a
+// TLB miss on a fraction of their probes.
+#define BLOOM_HUGE_PAGES 0x20U
+// Large-scale mode for classic filters far beyond 2^32 bits: keys get a 128 bit hash and each partition takes
+// its position from its own 64 bits of it, instead of every partition reducing one 64 bit hash. Cannot be
+// combined with BLOOM_BLOCKED, and the pre-hashed functions, which take 64 bit hashes, reject these filters.
+#define BLOOM_LARGE 0x40U
+// Pad every partition of a classic filter to a 64 bit word (BLOOM_ALIGN_WORDS) or a cache line
+// (BLOOM_ALIGN_LINES), so partitions start on aligned words and the probes load and store whole words. The
+// array must start on an 8 byte boundary. Costs up to a word or a line per partition. The two are exclusive, and
+// neither combines with BLOOM_BLOCKED.
+#define BLOOM_ALIGN_WORDS 0x80U
+#define BLOOM_ALIGN_LINES 0x100U
+
+// Pages backing an array allocated with BLOOM_HUGE_PAGES, as reported in 'pages'
+#define BLOOM_PAGES_DEFAULT 0
+#define BLOOM_PAGES_THP 1
+#define BLOOM_PAGES_2M 2
+#define BLOOM_PAGES_1G 3
+
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_BLOCK_BYTES (BLOOM_BLOCK_BITS / 8)
+#define BLOOM_BLOCK_MAX_PARTITIONS 16
+// A blocked filter may use up to this many times the classic size before p is deemed unreachable
+#define BLOOM_BLOCK_MAX_GROWTH 16
+
+// Width of the counters of a counting filter, one of 2, 4 or 8
+#ifndef BLOOM_COUNTER_BITS
+#define BLOOM_COUNTER_BITS 4
+#endif
+
+#define BLOOM_COUNTER_STRIPES 64
+#define BLOOM_STRIPE_WORDS 8
+
+#define BLOOM_SCALABLE_GROWTH 2
+#define BLOOM_SCALABLE_TIGHTENING 0.5
+
+// Probe kernels for bloom_select_kernel, in increasing order of capability
+#define BLOOM_KERNEL_AUTO (-1)
+#define BLOOM_KERNEL_SCALAR 0
+#define BLOOM_KERNEL_AVX2 1
+#define BLOOM_KERNEL_AVX512 2
+
+// Number of keys hashed and prefetched together by the batch functions
+#define BLOOM_BATCH_SIZE 16
+// Number of keys indexed by all threads of bloom_build_parallel before any of them sets bits
+#define BLOOM_BUILD_CHUNK 65536
+
+// Key hashes, recorded by id in every filter and its serialized header. Ids below BLOOM_HASH_CUSTOM are
+// built in, the rest up to BLOOM_HASH_MAX can be given a function with bloom_register_hash.
+#define BLOOM_HASH_XXH64 0
+#define BLOOM_HASH_XXH3 1
+#define BLOOM_HASH_CUSTOM 16
+#define BLOOM_HASH_MAX 64
+
+// Hash of new filters. XXH3 is faster on short keys but opt-in, through bloom_use_hash or by defining this
+// as BLOOM_HASH_XXH3. Arrays attached without a header (bloom_init_ex with data) record no hash, so they are
+// always probed with XXH64, the hash of every filter built before the hash was recorded. The built in hashes
+// are inlined at every call site, custom ones are called through hash_fn, and which one a filter uses is
+// checked on every hash. Defining this at build time pins the hash instead: hashing compiles down to the
+// chosen one, and filters recording any other hash are refused.
+#ifdef BLOOM_HASH_DEFAULT
+#define BLOOM_HASH_PINNED
+#else
+#define BLOOM_HASH_DEFAULT BLOOM_HASH_XXH64
+#endif
+
+typedef uint64_t (*bloom_hash_fn)(const void *data, size_t len, uint64_t seed);
+
+// Serialized filters start with a bloom_header in the prefix, followed by the partition lengths
+#define BLOOM_MAGIC 0x4642484FU  // "OHBF"
+#define BLOOM_VERSION 1
+#define BLOOM_ENDIAN_MARK 0x0102
+#define BLOOM_HEADER_LEN(k) (sizeof(bloom_header) + (k) * sizeof(uint64_t))
+// A prefix_len large enough for the header of any filter with up to 64 partitions, kept a multiple of
+// the cache line so blocked filters stay aligned
+#define BLOOM_HEADER_MAX_LEN 640
+
+// Flags for bloom_open_mmap. Without BLOOM_MAP_WRITE the filter is mapped read only and every call that would write
+// to it returns -1.
+#define BLOOM_MAP_WRITE 0x1U
+
 typedef struct bloom {
   uint8_t *base_ptr;
   uint8_t *bloom_ptr;
   uint64_t size;
   uint64_t *partition_lengths;
+  unsigned __int128 *partition_fastmod;
   uint64_t num_partitions;
   uint8_t **partition_ptrs;
+  uint64_t *partition_offsets;
+  struct bloom_lanes *lanes;
+  uint64_t num_blocks;
   double false_pos_rate;
   uint64_t total_size;
   uint64_t prefix_len;
   uint64_t num_elems;
+  uint64_t *elem_stripes;
+  uint64_t *partition_fill;
+  // Set by attaches, whose fill is counted from the array on the first estimate rather than up front
+  bool fill_pending;
   uint64_t capacity;
+  bloom_hash_fn hash_fn;
+  uint64_t hash_seed;
+  uint32_t hash_id;
+  uint32_t flags;
   bool alloced;
+  // Length of the mapping holding the filter (a file, or anonymous huge pages), 0 if it is not mapped
+  uint64_t map_len;
+  bool map_writable;
+  uint32_t pages;
 } bloom;
 
+// All fields are in the byte order of the writer, given by 'endianness'. header_checksum is the XXH64 of
+// the partition lengths seeded with the XXH64 of the header (header_checksum zeroed), data_checksum the
+// XXH64 of the bit array.
+typedef struct bloom_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t endianness;
+  uint32_t flags;
+  uint32_t hash_id;
+  uint64_t hash_seed;
+  double false_pos_rate;
+  uint64_t capacity;
+  uint64_t num_elems;
+  uint64_t num_partitions;
+  uint64_t num_blocks;
+  uint64_t size;
+  uint64_t prefix_len;
+  uint64_t data_checksum;
+  uint64_t header_checksum;
+} bloom_header;
+
+// A filter split into independent shards, each key routed to one shard by its hash. Every shard lives on
+// its own cache lines, so threads adding to different shards never contend.
+typedef struct bloom_shard {
+  bloom bf;
+} __attribute__((aligned(64))) bloom_shard;
+
+typedef struct bloom_sharded {
+  bloom_shard *shards;
+  uint64_t num_shards;
+} bloom_sharded;
+
+// A filter that grows as keys are added. Once the newest filter is at capacity, a filter with
+// BLOOM_SCALABLE_GROWTH times its capacity and BLOOM_SCALABLE_TIGHTENING times its p is appended, so the
+// rates form a geometric series and the compound false positive rate stays below the p given at init.
+typedef struct bloom_scalable {
+  bloom *filters;
+  uint64_t num_filters;
+  double false_pos_rate;
+  uint64_t initial_capacity;
+  uint32_t flags;
+} bloom_scalable;
+
+// A filter with one replica of its array on every NUMA node. Adds go to the primary, replicas[0], and
+// bloom_replicated_publish copies it to the other replicas; tests read the replica of the caller's node.
+// Counting filters are not supported, since removals would make publishing clear bits under readers.
+typedef struct bloom_replicated {
+  bloom *replicas;
+  uint64_t num_replicas;
+  // Replica index of every node id up to the highest online node
+  uint64_t *node_replica;
+  uint64_t num_nodes;
+  // Whether every replica's pages were placed on its node, by mbind or by faulting them in from the node's
+  // CPUs. When false some replicas may sit on another node; tests still work, only slower.
+  bool node_local;
+} bloom_replicated;
+
 bloom *bloom_alloc(double p, uint64_t n, uint8_t *data, uint64_t prefix_len);
 
 int bloom_init(bloom *bf, double p, uint64_t n, uint8_t *data, uint64_t prefix_len);
 
+bloom *bloom_alloc_ex(double p, uint64_t n, uint8_t *data, uint64_t prefix_len, uint32_t flags);
+
+int bloom_init_ex(bloom *bf, double p, uint64_t n, uint8_t *data, uint64_t prefix_len, uint32_t flags);
+
 void bloom_clear(bloom *bf);
 
 void bloom_free(bloom *bf);
@@ -34,13 +210,201 @@ void bloom_free(bloom *bf);
 uint8_t *bloom_get_filter(bloom *bf);
 
 uint8_t *bloom_get_prefix(bloom *bf);
+// Switches an empty filter to another registered hash and seed. Returns -1 once keys have been added.
+int bloom_use_hash(bloom *bf, uint32_t hash_id, uint64_t seed);
+// Registers the function for a custom hash id, so filters can use it and serialized filters naming it load
+int bloom_register_hash(uint32_t hash_id, bloom_hash_fn fn);
 
 int bloom_add(bloom *bf, uint8_t *data, uint64_t data_len);
 
 int bloom_test(bloom *bf, uint8_t *data, uint64_t data_len);
 
+// Adds a key that bloom_test reports as not present, in a single pass over its slots. Returns what bloom_test
+// returned before the add: 0 if the key was already present, 1 if it is new, and only new keys are counted.
+// On a BLOOM_CONCURRENT filter the slots are set with atomic ORs, so of several threads adding the same key at
+// once at least one sees it as new (more can, when each sets some of its bits first).
+int bloom_test_and_add(bloom *bf, uint8_t *data, uint64_t data_len);
+
+// bloom_add/bloom_test for keys of a fixed width, hashed by code specialised for that width. A key gives the
+// same hash as the same bytes passed to bloom_add, so the two can be mixed; integers are hashed in their
+// native byte order.
+int bloom_add_u32(bloom *bf, uint32_t key);
+
+int bloom_test_u32(bloom *bf, uint32_t key);
+
+int bloom_add_u64(bloom *bf, uint64_t key);
+
+int bloom_test_u64(bloom *bf, uint64_t key);
+
+int bloom_add_fixed16(bloom *bf, const uint8_t *key);
+
+int bloom_test_fixed16(bloom *bf, const uint8_t *key);
+
+int bloom_add_fixed32(bloom *bf, const uint8_t *key);
+
+int bloom_test_fixed32(bloom *bf, const uint8_t *key);
+
+// Removes a key from a counting filter. Returns 1 without changing the filter if the key is not present.
+int bloom_remove(bloom *bf, uint8_t *data, uint64_t data_len);
+
+// The hash bloom_add and bloom_test compute for a key with this filter's hash function and seed
+uint64_t bloom_key_hash(bloom *bf, uint8_t *data, uint64_t data_len);
+
+// bloom_add/bloom_test for a key already hashed with bloom_key_hash (or the same hash and seed), so a key
+// checked against several filters sharing a hash is only hashed once
+int bloom_add_hash(bloom *bf, uint64_t hash);
+
+int bloom_test_hash(bloom *bf, uint64_t hash);
+
+int bloom_test_and_add_hash(bloom *bf, uint64_t hash);
+
+// bloom_add_batch for keys already hashed with bloom_key_hash, for loaders that hash keys in place
+int bloom_add_hash_batch(bloom *bf, const uint64_t *hashes, uint64_t count);
+
+// Tests one key against several filters, which must share a hash and seed. The key is hashed once and the
+// probes of up to BLOOM_BATCH_SIZE filters are prefetched together; results[i] is what bloom_test would
+// return for filters[i].
+int bloom_test_many(bloom **filters, uint64_t num_filters, uint8_t *data, uint64_t data_len, uint8_t *results);
+
+// Keys are packed back to back in 'keys', key i spans [offsets[i], offsets[i + 1]), so 'offsets' holds count + 1 entries.
+int bloom_add_batch(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count);
+
+// results[i] receives the same value bloom_test would return for key i (0 if present, 1 if not).
+int bloom_test_batch(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count, uint8_t *results);
+
+// bloom_add_batch/bloom_test_batch for count keys of key_size bytes back to back, without an offsets array.
+// Widths of 4, 8, 16 and 32 bytes use the fixed width hashing of bloom_add_u64 and friends.
+int bloom_add_batch_fixed(bloom *bf, const uint8_t *keys, uint32_t key_size, uint64_t count);
+
+int bloom_test_batch_fixed(bloom *bf, const uint8_t *keys, uint32_t key_size, uint64_t count, uint8_t *results);
+
+// results[i] receives what bloom_test_and_add returns for key i, the keys being added in order
+int bloom_test_and_add_batch(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count, uint8_t *results);
+
+// bloom_add_batch spread over 'threads' threads (0 for one per online CPU), each setting the slots in its own
+// cache line aligned region of the array. The result is identical to adding the keys one by one, and any
+// filter flags are supported. On failure (a zero length key, or out of memory) the chunks of BLOOM_BUILD_CHUNK
+// keys before the failing one stay added and counted.
+int bloom_build_parallel(bloom *bf, uint8_t *keys, const uint64_t *offsets, uint64_t count, uint32_t threads);
+
+// Attaches bf to an array laid out with the given partition lengths, or allocates one if data is NULL, in
+// O(k). The flags, p, n, element count, prefix length and number of blocks are taken from 'layout', and a
+// non-zero layout->size must match the size the lengths give. data_len must cover the prefix and the array.
+int bloom_init_layout(bloom *bf, const bloom_header *layout, const uint64_t *lengths, uint8_t *data,
+                      uint64_t data_len);
+
+// Writes the header into the prefix, after which bloom_get_prefix(bf) holds the whole filter in
+// bf->total_size bytes. Fails if prefix_len is shorter than BLOOM_HEADER_LEN(bf->num_partitions).
+int bloom_serialize(bloom *bf);
+
+// Attaches bf to a serialized filter in 'buf' without copying or recomputing the partitions. The bit
+// array checksum is only checked when 'verify' is set, as it reads the whole array.
+int bloom_deserialize(bloom *bf, uint8_t *buf, uint64_t buf_len, bool verify);
+
+// Maps a filter file written by bloom_create_mmap or bloom_serialize. Pages are read in on first access
+// and shared with every other process mapping the file. bloom_clear unmaps it.
+bloom *bloom_open_mmap(const char *path, uint32_t map_flags);
+
+// Creates (or truncates) 'path' as a sparse file holding an empty filter and maps it for writing
+bloom *bloom_create_mmap(const char *path, double p, uint64_t n, uint32_t flags);
+
+// Rewrites the header of a writable mapped filter, without a data checksum, and flushes it to the file
+int bloom_sync(bloom *bf);
+
+// Union and intersection of two filters with identical partition lengths (and block count), written to
+// dst, which must share the layout and may be a or b. The element count of dst is set from the fill of
+// the result. Counting filters cannot be combined.
+int bloom_union(bloom *dst, bloom *a, bloom *b);
+
+int bloom_intersect(bloom *dst, bloom *a, bloom *b);
+
+// Estimated Jaccard similarity of the key sets of two compatible filters, from the fill of each and of
+// their union. 0 when both are empty, -1 if they are not compatible.
+double bloom_jaccard_estimate(bloom *a, bloom *b);
+
 void bloom_print(bloom *bf);
 
+// The probe kernel is picked from the CPU features on first use. Selecting one the CPU lacks returns -1. A
+// selection applies to existing filters from their next batch call; a call already running keeps its kernel.
+int bloom_select_kernel(int kernel);
+
+int bloom_active_kernel(void);
+
+// Capacity left, from the estimated distinct key count with BLOOM_TRACK_FILL, the number of adds otherwise
 uint64_t bloom_remaining_capacity(bloom *bf);
 
+// Estimated number of distinct keys added, from the fill of each partition. Duplicate adds are not counted,
+// unlike bloom_get_num_elems. Scans the array unless the filter tracks its fill.
+uint64_t bloom_estimate_count(bloom *bf);
+
+// Probability that a key not in the filter tests positive at its current fill
+double bloom_current_fpr(bloom *bf);
+
+// Number of elements added, summing the per-thread counts of a concurrent filter
+uint64_t bloom_get_num_elems(bloom *bf);
+
+bloom_sharded *bloom_sharded_alloc(double p, uint64_t n, uint64_t num_shards, uint32_t flags);
+
+int bloom_sharded_init(bloom_sharded *bs, double p, uint64_t n, uint64_t num_shards, uint32_t flags);
+
+void bloom_sharded_clear(bloom_sharded *bs);
+
+void bloom_sharded_free(bloom_sharded *bs);
+
+// bloom_use_hash for every shard
+int bloom_sharded_use_hash(bloom_sharded *bs, uint32_t hash_id, uint64_t seed);
+
+// The shard a key is routed to, so that writers can be assigned the keys of the shards they own
+uint64_t bloom_sharded_index(bloom_sharded *bs, uint8_t *data, uint64_t data_len);
+
+int bloom_sharded_add(bloom_sharded *bs, uint8_t *data, uint64_t data_len);
+
+int bloom_sharded_test(bloom_sharded *bs, uint8_t *data, uint64_t data_len);
+
+uint64_t bloom_sharded_get_num_elems(bloom_sharded *bs);
+
+uint64_t bloom_sharded_remaining_capacity(bloom_sharded *bs);
+
+void bloom_sharded_print(bloom_sharded *bs);
+
+// Growing filters are not safe for concurrent adds, so BLOOM_CONCURRENT is rejected
+bloom_scalable *bloom_scalable_alloc(double p, uint64_t n, uint32_t flags);
+
+int bloom_scalable_init(bloom_scalable *bs, double p, uint64_t n, uint32_t flags);
+
+void bloom_scalable_clear(bloom_scalable *bs);
+
+void bloom_scalable_free(bloom_scalable *bs);
+
+// bloom_use_hash for the filter and every filter it grows into
+int bloom_scalable_use_hash(bloom_scalable *bs, uint32_t hash_id, uint64_t seed);
+
+int bloom_scalable_add(bloom_scalable *bs, uint8_t *data, uint64_t data_len);
+
+int bloom_scalable_test(bloom_scalable *bs, uint8_t *data, uint64_t data_len);
+
+uint64_t bloom_scalable_get_num_elems(bloom_scalable *bs);
+
+void bloom_scalable_print(bloom_scalable *bs);
+
+bloom_replicated *bloom_replicated_alloc(double p, uint64_t n, uint32_t flags);
+
+int bloom_replicated_init(bloom_replicated *br, double p, uint64_t n, uint32_t flags);
+
+void bloom_replicated_clear(bloom_replicated *br);
+
+void bloom_replicated_free(bloom_replicated *br);
+
+// Adds to the primary. Readers on other nodes see the key once it has been published.
+int bloom_replicated_add(bloom_replicated *br, uint8_t *data, uint64_t data_len);
+
+// Copies the primary, including anything merged into it with bloom_union, to every other replica. Bits
+// only go from 0 to 1, so readers may keep testing while a replica is overwritten.
+int bloom_replicated_publish(bloom_replicated *br);
+
+int bloom_replicated_test(bloom_replicated *br, uint8_t *data, uint64_t data_len);
+
+// The replica on the calling thread's node, for use with the bloom_test family
+bloom *bloom_replicated_local(bloom_replicated *br);
+
 #endif  // BLOOM_OHBF_H
@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bloom.h"
+
+// The input is cut into blocks of whole keys, which the worker threads parse in place and hash while the
+// reader cuts the next ones. Hashes are inserted in batches of build_hash_batch under a lock, so one worker
+// inserts while the others keep hashing.
+#define build_block_bytes (4U << 20)
+#define build_hash_batch 16384U
+#define build_max_threads 256
+#define build_max_blocks (2 * build_max_threads + 2)
+// Bytes of a mapped input read to estimate n, spread over build_sample_points windows
+#define build_sample_bytes (64U << 20)
+#define build_sample_points 16
+
+enum build_format { build_lines, build_len32, build_fixed };
+
+typedef struct build_block {
+	const uint8_t *data;
+	uint64_t len;
+	// Stream input is read into the block's own buffer, mapped input is parsed in the mapping
+	uint8_t *buf;
+	uint64_t buf_cap;
+	bool busy;
+} build_block;
+
+typedef struct build_config {
+	int format;
+	uint32_t width;
+	double p;
+	uint64_t n;
+	uint32_t flags;
+	uint32_t hash_id;
+	int num_threads;
+	bool verbose;
+} build_config;
+
+typedef struct build_state {
+	build_config *cfg;
+	bloom *bf;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_mutex_t insert;
+	build_block blocks[build_max_blocks];
+	uint32_t num_blocks;
+	uint64_t num_read;
+	uint64_t num_taken;
+	uint64_t bytes;
+	bool done;
+	int error;
+} build_state;
+
+typedef struct build_worker {
+	build_state *st;
+	pthread_t id;
+	uint64_t keys;
+	uint64_t skipped;
+} build_worker;
+
+double build_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Length of the whole keys at the start of data[0, len), which is 0 if the first key runs past len. At the
+// end of the input a last line without a newline is a whole key.
+static uint64_t build_whole_keys(build_config *cfg, const uint8_t *data, uint64_t len, bool end)
+{
+	if (cfg->format == build_lines) {
+		const uint8_t *nl = end ? NULL : memrchr(data, '\n', len);
+		return end ? len : nl ? (uint64_t) (nl - data) + 1 : 0;
+	}
+	if (cfg->format == build_fixed) {
+		return len / cfg->width * cfg->width;
+	}
+	uint64_t pos = 0;
+	uint32_t key_len;
+	while (len - pos >= sizeof key_len) {
+		memcpy(&key_len, data + pos, sizeof key_len);
+		if (len - pos - sizeof key_len < le32toh(key_len)) {
+			break;
+		}
+		pos += sizeof key_len + le32toh(key_len);
+	}
+	return pos;
+}
+
+// The key at data[*pos] in a block of whole keys, which is parsed in place. *pos is moved past it.
+static inline const uint8_t *build_next_key(build_config *cfg, const uint8_t *data, uint64_t len, uint64_t *pos,
+                                            uint64_t *key_len)
+{
+	const uint8_t *key = data + *pos;
+	if (cfg->format == build_lines) {
+		const uint8_t *nl = memchr(key, '\n', len - *pos);
+		*key_len = nl ? (uint64_t) (nl - key) : len - *pos;
+		*pos += *key_len + 1;
+	} else if (cfg->format == build_fixed) {
+		*key_len = cfg->width;
+		*pos += *key_len;
+	} else {
+		uint32_t prefix;
+		memcpy(&prefix, key, sizeof prefix);
+		*key_len = le32toh(prefix);
+		*pos += sizeof prefix + *key_len;
+		key += sizeof prefix;
+	}
+	return key;
+}
+
+static void build_insert(build_state *st, const uint64_t *hashes, uint64_t count)
+{
+	pthread_mutex_lock(&st->insert);
+	bloom_add_hash_batch(st->bf, hashes, count);
+	pthread_mutex_unlock(&st->insert);
+}
+
+void *build_worker_run(void *arg)
+{
+	build_worker *w = arg;
+	build_state *st = w->st;
+	uint64_t *hashes = malloc(build_hash_batch * sizeof *hashes);
+	uint64_t num_hashes = 0;
+
+	pthread_mutex_lock(&st->lock);
+	if (!hashes) {
+		st->error = ENOMEM;
+	}
+	for (;;) {
+		while (st->num_taken == st->num_read && !st->done) {
+			pthread_cond_wait(&st->changed, &st->lock);
+		}
+		if (st->num_taken == st->num_read) {
+			break;
+		}
+		build_block *block = &st->blocks[st->num_taken++ % st->num_blocks];
+		pthread_mutex_unlock(&st->lock);
+
+		// Without a hash buffer the blocks are still taken, so the reader is not left waiting for them
+		for (uint64_t pos = 0; pos < block->len && hashes;) {
+			uint64_t key_len;
+			const uint8_t *key = build_next_key(st->cfg, block->data, block->len, &pos, &key_len);
+			// Zero-length keys cannot be added, so empty lines are skipped
+			if (!key_len) {
+				w->skipped++;
+				continue;
+			}
+			hashes[num_hashes++] = bloom_key_hash(st->bf, (uint8_t *) key, key_len);
+			if (num_hashes == build_hash_batch) {
+				build_insert(st, hashes, num_hashes);
+				w->keys += num_hashes;
+				num_hashes = 0;
+			}
+		}
+
+		pthread_mutex_lock(&st->lock);
+		block->busy = false;
+		pthread_cond_broadcast(&st->changed);
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	if (num_hashes) {
+		build_insert(st, hashes, num_hashes);
+		w->keys += num_hashes;
+	}
+	free(hashes);
+	return NULL;
+}
+
+// Waits for the next block in reading order to be free again
+static build_block *build_next_block(build_state *st)
+{
+	pthread_mutex_lock(&st->lock);
+	build_block *block = &st->blocks[st->num_read % st->num_blocks];
+	while (block->busy) {
+		pthread_cond_wait(&st->changed, &st->lock);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return block;
+}
+
+static void build_submit(build_state *st, build_block *block)
+{
+	pthread_mutex_lock(&st->lock);
+	block->busy = true;
+	st->num_read++;
+	pthread_cond_signal(&st->changed);
+	pthread_mutex_unlock(&st->lock);
+}
+
+// Cuts a mapped input into blocks that point into the mapping
+static int build_read_mapped(build_state *st, const uint8_t *map, uint64_t size)
+{
+	for (uint64_t pos = 0; pos < size;) {
+		uint64_t window = build_block_bytes;
+		uint64_t whole = 0;
+		// A key longer than the window widens it until the key fits
+		while (!whole) {
+			window = window < size - pos ? window : size - pos;
+			whole = build_whole_keys(st->cfg, map + pos, window, pos + window == size);
+			if (!whole && pos + window == size) {
+				return EINVAL;
+			}
+			window *= 2;
+		}
+		build_block *block = build_next_block(st);
+		block->data = map + pos;
+		block->len = whole;
+		build_submit(st, block);
+		pos += whole;
+		st->bytes += whole;
+	}
+	return 0;
+}
+
+// Reads a stream into the blocks' buffers, moving the partial key at the end of each block to the next
+static int build_read_stream(build_state *st, int fd)
+{
+	uint8_t *carry = NULL;
+	uint64_t carry_len = 0;
+	bool end = false;
+	int err = 0;
+	while (!end && !err) {
+		build_block *block = build_next_block(st);
+		uint64_t cap = build_block_bytes > 2 * carry_len ? build_block_bytes : 2 * carry_len;
+		if (block->buf_cap < cap) {
+			uint8_t *buf = realloc(block->buf, cap);
+			if (!buf) {
+				err = ENOMEM;
+				break;
+			}
+			block->buf = buf;
+			block->buf_cap = cap;
+		}
+		if (carry_len) {
+			memcpy(block->buf, carry, carry_len);
+		}
+		uint64_t len = carry_len;
+		while (len < block->buf_cap && !end && !err) {
+			ssize_t got = read(fd, block->buf + len, block->buf_cap - len);
+			if (got < 0 && errno != EINTR) {
+				err = errno;
+			}
+			len += got > 0 ? got : 0;
+			end = !got;
+		}
+		if (err) {
+			break;
+		}
+
+		uint64_t whole = build_whole_keys(st->cfg, block->buf, len, end);
+		if (end && whole < len) {
+			err = EINVAL;
+			break;
+		}
+		// Nothing whole in a full buffer: the next block is made large enough for the key
+		uint8_t *next_carry = malloc(len - whole + 1);
+		if (!next_carry) {
+			err = ENOMEM;
+			break;
+		}
+		memcpy(next_carry, block->buf + whole, len - whole);
+		free(carry);
+		carry = next_carry;
+		carry_len = len - whole;
+
+		block->data = block->buf;
+		block->len = whole;
+		st->bytes += whole;
+		if (whole) {
+			build_submit(st, block);
+		}
+	}
+	free(carry);
+	return err;
+}
+
+// Keys in a mapped input, estimated from the key density of evenly spread windows. Fixed-width keys are
+// counted exactly, and length-prefixed keys can only be sampled from the start.
+uint64_t build_estimate_n(build_config *cfg, const uint8_t *map, uint64_t size)
+{
+	if (cfg->format == build_fixed) {
+		return size / cfg->width;
+	}
+	uint64_t points = cfg->format == build_lines && size > build_sample_bytes ? build_sample_points : 1;
+	uint64_t window = build_sample_bytes / points;
+	uint64_t keys = 0;
+	uint64_t bytes = 0;
+	for (uint64_t i = 0; i < points; i++) {
+		uint64_t start = size / points * i;
+		// Windows past the first start after the next newline
+		const uint8_t *nl = start ? memchr(map + start, '\n', size - start) : NULL;
+		start = start ? nl ? (uint64_t) (nl - map) + 1 : size : 0;
+		uint64_t len = window < size - start ? window : size - start;
+		len = build_whole_keys(cfg, map + start, len, start + len == size);
+		for (uint64_t pos = 0; pos < len;) {
+			uint64_t key_len;
+			build_next_key(cfg, map + start, len, &pos, &key_len);
+			keys += key_len > 0;
+		}
+		bytes += len;
+	}
+	if (bytes == size || !bytes) {
+		return keys;
+	}
+	return (uint64_t) ((double) keys / bytes * size) + 1;
+}
+
+static int build_write(bloom *bf, const char *path)
+{
+	char tmp[4096];
+	if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int) sizeof tmp || bloom_serialize(bf)) {
+		return -1;
+	}
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	const uint8_t *data = bloom_get_prefix(bf);
+	for (uint64_t pos = 0; pos < bf->total_size;) {
+		ssize_t put = write(fd, data + pos, bf->total_size - pos);
+		if (put < 0 && errno != EINTR) {
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		pos += put > 0 ? put : 0;
+	}
+	// The filter only replaces 'path' once it is completely written
+	if (fsync(fd) || close(fd) || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+void build_usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options] INPUT OUTPUT\n"
+	        "Builds a filter from the keys in INPUT ('-' for stdin) and writes it serialized to OUTPUT.\n"
+	        "  -p P          false positive rate (default 0.01)\n"
+	        "  -n N          expected number of keys (default: estimated by sampling INPUT, which must be a file)\n"
+	        "  -f FORMAT     lines (one key per line), len32 (each key after its 32-bit little-endian length) or\n"
+	        "                fixed (keys of -w bytes back to back) (default lines)\n"
+	        "  -w WIDTH      key width in bytes for -f fixed\n"
+	        "  -t THREADS    parsing and hashing threads (default: online CPUs)\n"
+	        "  -l LAYOUT     classic, blocked, words or lines (classic with partitions aligned to 64 bit words or\n"
+	        "                cache lines) (default classic)\n"
+	        "  -P PAGES      4k or huge (BLOOM_HUGE_PAGES) (default huge)\n"
+	        "  -H HASH       xxh64 or xxh3 (default xxh64)\n"
+	        "  -v            print statistics to stderr\n",
+	        name);
+}
+
+int main(int argc, char **argv)
+{
+	build_config cfg = {
+		.format = build_lines,
+		.p = 0.01,
+		.flags = BLOOM_HUGE_PAGES,
+		.hash_id = BLOOM_HASH_DEFAULT,
+		.num_threads = sysconf(_SC_NPROCESSORS_ONLN),
+	};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:n:f:w:t:l:P:H:vh")) != -1) {
+		int err = 0;
+		switch (opt) {
+		case 'p': cfg.p = strtod(optarg, NULL); break;
+		case 'n': cfg.n = strtoull(optarg, NULL, 10); break;
+		case 'w': cfg.width = strtoul(optarg, NULL, 10); break;
+		case 't': cfg.num_threads = atoi(optarg); break;
+		case 'v': cfg.verbose = true; break;
+		case 'f':
+			cfg.format = !strcmp(optarg, "lines") ? build_lines : !strcmp(optarg, "len32") ? build_len32 :
+			             !strcmp(optarg, "fixed") ? build_fixed : -1;
+			err = cfg.format < 0;
+			break;
+		case 'l':
+			err = strcmp(optarg, "classic") && strcmp(optarg, "blocked") && strcmp(optarg, "words")
+			      && strcmp(optarg, "lines");
+			cfg.flags &= ~(BLOOM_BLOCKED | BLOOM_ALIGN_WORDS | BLOOM_ALIGN_LINES);
+			cfg.flags |= !strcmp(optarg, "blocked") ? BLOOM_BLOCKED : !strcmp(optarg, "words") ? BLOOM_ALIGN_WORDS :
+			             !strcmp(optarg, "lines") ? BLOOM_ALIGN_LINES : 0;
+			break;
+		case 'P':
+			err = strcmp(optarg, "4k") && strcmp(optarg, "huge");
+			cfg.flags = !strcmp(optarg, "huge") ? cfg.flags | BLOOM_HUGE_PAGES : cfg.flags & ~BLOOM_HUGE_PAGES;
+			break;
+		case 'H':
+			cfg.hash_id = !strcmp(optarg, "xxh64") ? BLOOM_HASH_XXH64 : !strcmp(optarg, "xxh3") ? BLOOM_HASH_XXH3 :
+			              BLOOM_HASH_MAX;
+			err = cfg.hash_id == BLOOM_HASH_MAX;
+			break;
+		default: err = 1;
+		}
+		if (err) {
+			build_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2 || cfg.p <= 0 || cfg.p >= 1 || cfg.num_threads < 1 ||
+	    cfg.num_threads > build_max_threads || (cfg.format == build_fixed) != (cfg.width > 0)) {
+		build_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *input = argv[optind];
+	const char *output = argv[optind + 1];
+
+	int fd = strcmp(input, "-") ? open(input, O_RDONLY) : STDIN_FILENO;
+	struct stat st_in;
+	if (fd < 0 || fstat(fd, &st_in)) {
+		fprintf(stderr, "%s: %s\n", input, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	// Regular files are parsed in place in a read-only mapping, pipes are streamed through the blocks
+	uint64_t size = S_ISREG(st_in.st_mode) ? (uint64_t) st_in.st_size : 0;
+	const uint8_t *map = NULL;
+	if (size) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "%s: %s\n", input, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		madvise((void *) map, size, MADV_SEQUENTIAL);
+	}
+
+	double start = build_now();
+	if (!cfg.n && !S_ISREG(st_in.st_mode)) {
+		fprintf(stderr, "-n is required when reading from a pipe\n");
+		return EXIT_FAILURE;
+	}
+	if (!cfg.n) {
+		cfg.n = map ? build_estimate_n(&cfg, map, size) : 0;
+		cfg.n = cfg.n ? cfg.n : 1;
+	}
+	double estimated = build_now();
+
+	build_state st = {
+		.cfg = &cfg,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.changed = PTHREAD_COND_INITIALIZER,
+		.insert = PTHREAD_MUTEX_INITIALIZER,
+		.num_blocks = 2 * cfg.num_threads + 2,
+	};
+	st.bf = bloom_alloc_ex(cfg.p, cfg.n, NULL, BLOOM_HEADER_MAX_LEN, cfg.flags);
+	if (!st.bf || bloom_use_hash(st.bf, cfg.hash_id, 0)) {
+		fprintf(stderr, "fatal alloc error\n");
+		return EXIT_FAILURE;
+	}
+
+	build_worker workers[build_max_threads] = {0};
+	int started = 0;
+	for (int i = 0; i < cfg.num_threads; i++) {
+		workers[started].st = &st;
+		started += !pthread_create(&workers[started].id, NULL, build_worker_run, &workers[started]);
+	}
+	int err = !started ? EAGAIN : map ? build_read_mapped(&st, map, size) : build_read_stream(&st, fd);
+	pthread_mutex_lock(&st.lock);
+	st.done = true;
+	pthread_cond_broadcast(&st.changed);
+	pthread_mutex_unlock(&st.lock);
+
+	uint64_t keys = 0;
+	uint64_t skipped = 0;
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].id, NULL);
+		keys += workers[i].keys;
+		skipped += workers[i].skipped;
+	}
+	for (uint32_t i = 0; i < st.num_blocks; i++) {
+		free(st.blocks[i].buf);
+	}
+	err = err ? err : st.error;
+	if (err) {
+		fprintf(stderr, "%s: %s\n", input, err == EINVAL ? "truncated key at end of input" : strerror(err));
+		return EXIT_FAILURE;
+	}
+	double built = build_now();
+
+	if (build_write(st.bf, output)) {
+		fprintf(stderr, "%s: %s\n", output, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	double end = build_now();
+
+	if (cfg.verbose) {
+		fprintf(stderr,
+		        "keys %lu (%lu empty skipped) | n %lu | filter %lu bytes, %lu partitions\n"
+		        "estimate %.3fs | build %.3fs, %.1f Mkeys/s, %.2f GB/s | write %.3fs\n",
+		        keys, skipped, cfg.n, st.bf->size, st.bf->num_partitions, estimated - start, built - estimated,
+		        keys / (built - estimated) / 1e6, st.bytes / (built - estimated) / 1e9, end - built);
+		if (keys > st.bf->capacity) {
+			fprintf(stderr, "warning: %lu keys exceed the capacity of %lu\n", keys, st.bf->capacity);
+		}
+	}
+	if (map) {
+		munmap((void *) map, size);
+	}
+	bloom_free(st.bf);
+	return EXIT_SUCCESS;
+}
@@ -1,11 +1,17 @@
+#include <stddef.h>
 #include <string.h>
 #include <utime.h>
+#include <pthread.h>
 #include <sys/random.h>
+#include <unistd.h>
 #include "bloom.h"
 
 #define test_num_elems 1000UL
+// The false positive rate checks need many lookups; every other test only checks results, on fewer keys
 #define test_num_lookups 9000000ULL
+#define test_num_keys 100000U
 #define key_size 32U
+#define test_num_threads 4
 
 int get_random(void *buf, size_t count) {
     if (count <= 0) {
@@ -56,6 +62,112 @@ int test_bloom_lookup(bloom* bf, uint8_t* data_array, uint32_t elem_size, uint32
 		return 0;
 }
 
+int test_bloom_positions(bloom *bf, uint8_t *data_array, uint32_t elem_size, uint32_t num_elems)
+{
+	uint8_t *data_ptr = data_array;
+	long mismatch = 0;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		uint64_t hash = bf->hash_fn(data_ptr, elem_size, bf->hash_seed);
+		for (uint64_t j = 0; j < bf->num_partitions; j++) {
+			uint64_t bit = hash % bf->partition_lengths[j];
+			mismatch += !(bf->partition_ptrs[j][bit / 8] & 1 << bit % 8);
+		}
+		data_ptr += elem_size;
+	}
+	printf("Partition positions match hash %% length: %s\n", mismatch ? "NO" : "yes");
+	return mismatch ? -1 : 0;
+}
+
+// Headerless arrays are attached by recomputing their layout from (p, n), so the partitions chosen for a
+// configuration must never change. These are the lengths the original full sieve picked.
+int test_bloom_partitions(void)
+{
+	static const struct {
+		double p;
+		uint64_t n;
+		uint64_t k;
+		uint64_t lengths[40];
+	} known[] = {
+		{0.371535, 10238, 2, {10531, 10559}},
+		{0.01, 1000, 7, {1327, 1361, 1367, 1373, 1381, 1399, 1409}},
+		{0.01, 10, 7, {7, 11, 13, 17, 19, 23, 29}},
+		{0.001, 50, 10, {53, 59, 61, 67, 71, 73, 79, 83, 89, 97}},
+		{0.05, 7, 5, {7, 11, 13, 17, 19}},
+		{1e-06, 20, 20, {31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113}},
+		{0.5, 3, 2, {5, 7}},
+		{1e-09, 100, 30, {71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163,
+		                  167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227}},
+		{0.2, 100000, 3, {111653, 111659, 111667}},
+		{1e-12, 5, 40, {67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157, 163,
+		                167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233, 239, 241, 251, 257, 263,
+		                269, 271}},
+	};
+
+	long mismatch = 0;
+	for (uint64_t c = 0; c < sizeof known / sizeof *known; c++) {
+		bloom bf;
+		if (bloom_init_ex(&bf, known[c].p, known[c].n, NULL, 0, 0)) {
+			mismatch++;
+			continue;
+		}
+		mismatch += bf.num_partitions != known[c].k;
+		for (uint64_t i = 0; i < bf.num_partitions && i < known[c].k; i++) {
+			mismatch += bf.partition_lengths[i] != known[c].lengths[i];
+		}
+		bloom_clear(&bf);
+	}
+	printf("Partition lengths of known configurations: %s\n", mismatch ? "MISMATCH" : "match");
+	return mismatch ? -1 : 0;
+}
+
+static int test_is_prime(uint64_t x)
+{
+	for (uint64_t d = 2; d * d <= x; d++) {
+		if (x % d == 0) {
+			return 0;
+		}
+	}
+	return x >= 2;
+}
+
+// The windowed sieve must pick the primes a full sieve would. Each configuration is pinned by its
+// partition count and first length, with the rest required to be the primes that follow it. The small n,
+// large k configurations have fewer than k primes below the average, so the window has to widen.
+int test_bloom_prime_window(void)
+{
+	static const struct {
+		double p;
+		uint64_t n;
+		uint64_t k;
+		uint64_t first;
+	} known[] = {
+		{0.01, 10, 7, 7},         {0.01, 1000, 7, 1327},       {0.01, 10000000, 7, 13692881},
+		{1e-06, 50, 20, 31},      {1e-06, 100000, 20, 143669}, {1e-12, 2, 41, 113},
+		{1e-30, 1, 100, 139},     {1e-30, 5, 100, 173},        {1e-30, 100000, 100, 143159},
+		{1e-100, 2, 333, 953},    {1e-100, 50, 333, 1117},     {1e-100, 10000000, 333, 14389217},
+		{1e-300, 1, 997, 1439},   {1e-300, 1000, 997, 5333},   {1e-300, 100000, 997, 138247},
+	};
+
+	long mismatch = 0;
+	for (uint64_t c = 0; c < sizeof known / sizeof *known; c++) {
+		bloom bf;
+		if (bloom_init_ex(&bf, known[c].p, known[c].n, NULL, 0, 0)) {
+			mismatch++;
+			continue;
+		}
+		mismatch += bf.num_partitions != known[c].k || bf.partition_lengths[0] != known[c].first;
+		for (uint64_t i = 1; i < bf.num_partitions; i++) {
+			mismatch += !test_is_prime(bf.partition_lengths[i]);
+			for (uint64_t x = bf.partition_lengths[i - 1] + 1; x < bf.partition_lengths[i]; x++) {
+				mismatch += test_is_prime(x);
+			}
+		}
+		bloom_clear(&bf);
+	}
+	printf("Windowed prime selection matches full sieve: %s\n", mismatch ? "MISMATCH" : "match");
+	return mismatch ? -1 : 0;
+}
+
 uint8_t *test_generate_data(uint32_t elem_size, uint32_t num_elems)
 {
 	uint8_t *data_array = calloc(num_elems, elem_size);
@@ -68,20 +180,1270 @@ uint8_t *test_generate_data(uint32_t elem_size, uint32_t num_elems)
 	return data_array;
 }
 
+uint64_t *test_generate_offsets(uint32_t elem_size, uint32_t num_elems)
+{
+	uint64_t *offsets = calloc((uint64_t) num_elems + 1, sizeof *offsets);
+	if (!offsets) {
+		fprintf(stderr, "fatal calloc error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint64_t i = 0; i <= num_elems; i++) {
+		offsets[i] = i * elem_size;
+	}
+	return offsets;
+}
+
+int test_bloom_batch(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems)
+{
+	bloom *loop_bf = bloom_alloc(0.01, num_elems, NULL, 0);
+	bloom *batch_bf = bloom_alloc(0.01, num_elems, NULL, 0);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!loop_bf || !batch_bf || !results) {
+		fprintf(stderr, "fatal calloc error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	test_bloom_add(loop_bf, data_array, elem_size, num_elems / 2);
+	bloom_add_batch(batch_bf, data_array, offsets, num_elems / 2);
+
+	uint8_t *data_ptr = data_array;
+	long pos = 0;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		pos += !bloom_test(loop_bf, data_ptr, elem_size);
+		data_ptr += elem_size;
+	}
+	bloom_test_batch(batch_bf, data_array, offsets, num_elems, results);
+
+	long batch_pos = 0;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		batch_pos += !results[i];
+	}
+
+	int res = pos != batch_pos || memcmp(loop_bf->bloom_ptr, batch_bf->bloom_ptr, loop_bf->size);
+	printf("Batch vs per-key (%u elements): positive per-key %ld | batch %ld | %s\n", num_elems, pos, batch_pos,
+	       res ? "MISMATCH" : "match");
+
+	bloom_free(loop_bf);
+	bloom_free(batch_bf);
+	free(offsets);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_kernels(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	static const char *names[] = {"scalar", "avx2", "avx512"};
+	// The filter is created while the scalar kernel is selected, and must still take the others selected below
+	int active = bloom_active_kernel();
+	bloom_select_kernel(BLOOM_KERNEL_SCALAR);
+	bloom *bf = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, flags);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *expected = calloc(num_elems, 1);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!bf || !expected || !results) {
+		fprintf(stderr, "fatal calloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(bf, data_array, offsets, num_elems / 2);
+
+	uint8_t *data_ptr = data_array;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		expected[i] = bloom_test(bf, data_ptr, elem_size);
+		data_ptr += elem_size;
+	}
+
+	int res = active != BLOOM_KERNEL_SCALAR && !bf->lanes;
+	for (int kernel = BLOOM_KERNEL_SCALAR; kernel <= active; kernel++) {
+		bloom_select_kernel(kernel);
+		bloom_test_batch(bf, data_array, offsets, num_elems, results);
+		int mismatch = memcmp(results, expected, num_elems) != 0;
+		printf("Kernel %-6s (%s): batch test | %s\n", names[kernel], flags & BLOOM_BLOCKED ? "blocked" : "classic",
+		       mismatch ? "MISMATCH" : "match");
+		res |= mismatch;
+	}
+	bloom_select_kernel(active);
+
+	bloom_free(bf);
+	free(offsets);
+	free(expected);
+	free(results);
+	return res ? -1 : 0;
+}
+
+typedef struct test_thread_arg {
+	bloom *bf;
+	uint8_t *data;
+	uint32_t num_elems;
+	long positive;
+} test_thread_arg;
+
+void *test_concurrent_add(void *arg)
+{
+	test_thread_arg *t = arg;
+	test_bloom_add(t->bf, t->data, key_size, t->num_elems);
+	return NULL;
+}
+
+void *test_concurrent_lookup(void *arg)
+{
+	test_thread_arg *t = arg;
+	uint8_t *data_ptr = t->data;
+	for (uint32_t i = 0; i < t->num_elems; i++) {
+		t->positive += !bloom_test(t->bf, data_ptr, key_size);
+		data_ptr += key_size;
+	}
+	return NULL;
+}
+
+int test_bloom_concurrent(uint8_t *data_array, uint32_t num_elems)
+{
+	bloom *bf = bloom_alloc_ex(0.01, num_elems, NULL, 0, BLOOM_CONCURRENT);
+	if (!bf) {
+		fprintf(stderr, "Fatal calloc error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t threads[test_num_threads + 1];
+	test_thread_arg args[test_num_threads + 1];
+	uint32_t per_thread = num_elems / test_num_threads;
+	for (int i = 0; i <= test_num_threads; i++) {
+		// The reader looks up the keys the first writer is adding
+		uint64_t slice = i < test_num_threads ? i : 0;
+		args[i] = (test_thread_arg) {bf, data_array + slice * per_thread * key_size, per_thread, 0};
+		pthread_create(&threads[i], NULL, i < test_num_threads ? test_concurrent_add : test_concurrent_lookup, &args[i]);
+	}
+	for (int i = 0; i <= test_num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	uint8_t *data_ptr = data_array;
+	long missing = 0;
+	for (uint32_t i = 0; i < per_thread * test_num_threads; i++) {
+		missing += bloom_test(bf, data_ptr, key_size);
+		data_ptr += key_size;
+	}
+	printf("Concurrent add (%d threads + 1 reader): count %lu of %u | missing %ld\n", test_num_threads,
+	       bloom_get_num_elems(bf), per_thread * test_num_threads, missing);
+
+	bloom_free(bf);
+	return missing ? -1 : 0;
+}
+
+typedef struct test_shard_arg {
+	bloom_sharded *bs;
+	uint8_t *data;
+	uint32_t num_elems;
+	uint64_t shard_start;
+	uint64_t shard_end;
+} test_shard_arg;
+
+void *test_sharded_add(void *arg)
+{
+	test_shard_arg *t = arg;
+	uint8_t *data_ptr = t->data;
+	for (uint32_t i = 0; i < t->num_elems; i++) {
+		uint64_t shard = bloom_sharded_index(t->bs, data_ptr, key_size);
+		if (shard >= t->shard_start && shard < t->shard_end) {
+			bloom_sharded_add(t->bs, data_ptr, key_size);
+		}
+		data_ptr += key_size;
+	}
+	return NULL;
+}
+
+int test_bloom_sharded(uint8_t *data_array, uint32_t num_elems, uint64_t num_shards, uint32_t flags,
+                       uint32_t hash_id)
+{
+	bloom_sharded *bs = bloom_sharded_alloc(0.01, num_elems / 2, num_shards, flags);
+	if (!bs || bloom_sharded_use_hash(bs, hash_id, 0)) {
+		fprintf(stderr, "Fatal calloc error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Each writer owns a range of shards, so no two threads ever write to the same filter
+	pthread_t threads[test_num_threads];
+	test_shard_arg args[test_num_threads];
+	uint64_t per_thread = num_shards / test_num_threads;
+	for (int i = 0; i < test_num_threads; i++) {
+		uint64_t end = i + 1 < test_num_threads ? (i + 1) * per_thread : num_shards;
+		args[i] = (test_shard_arg) {bs, data_array, num_elems / 2, i * per_thread, end};
+		pthread_create(&threads[i], NULL, test_sharded_add, &args[i]);
+	}
+	for (int i = 0; i < test_num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	uint8_t *data_ptr = data_array;
+	long missing = 0;
+	long pos = 0;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		if (i < num_elems / 2) {
+			missing += bloom_sharded_test(bs, data_ptr, key_size);
+		} else {
+			pos += !bloom_sharded_test(bs, data_ptr, key_size);
+		}
+		data_ptr += key_size;
+	}
+
+	// Every key must have landed in the shard bloom_sharded_index names, which is what writers partition on
+	uint64_t *counts = calloc(num_shards, sizeof *counts);
+	if (!counts) {
+		fprintf(stderr, "Fatal calloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	long misrouted = 0;
+	data_ptr = data_array;
+	for (uint32_t i = 0; i < num_elems / 2; i++) {
+		uint64_t shard = bloom_sharded_index(bs, data_ptr, key_size);
+		counts[shard]++;
+		misrouted += bloom_test(&bs->shards[shard].bf, data_ptr, key_size);
+		data_ptr += key_size;
+	}
+	for (uint64_t i = 0; i < num_shards; i++) {
+		misrouted += counts[i] != bloom_get_num_elems(&bs->shards[i].bf);
+	}
+	free(counts);
+
+	printf("Sharded (%lu shards, flags %#x, hash %u): count %lu | missing %ld | misrouted %ld | fake pos rate %f\n",
+	       num_shards, flags, hash_id, bloom_sharded_get_num_elems(bs), missing, misrouted,
+	       (double) pos / (num_elems - num_elems / 2));
+
+	bloom_sharded_free(bs);
+	return missing || misrouted ? -1 : 0;
+}
+
+int test_bloom_serialize(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	bloom *bf = bloom_alloc_ex(0.01, num_elems, NULL, BLOOM_HEADER_MAX_LEN, flags);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *expected = calloc(num_elems, 1);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!bf || !expected || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(bf, data_array, offsets, num_elems / 2);
+	bloom_test_batch(bf, data_array, offsets, num_elems, expected);
+
+	int res = bloom_serialize(bf);
+	uint8_t *buf = malloc(bf->total_size);
+	memcpy(buf, bloom_get_prefix(bf), bf->total_size);
+
+	bloom loaded;
+	res |= bloom_deserialize(&loaded, buf, bf->total_size, true);
+	if (!res) {
+		bloom_test_batch(&loaded, data_array, offsets, num_elems, results);
+		res |= memcmp(expected, results, num_elems) || bloom_get_num_elems(&loaded) != num_elems / 2
+		       || loaded.size != bf->size;
+		bloom_clear(&loaded);
+	}
+
+	bloom rejected;
+	buf[offsetof(bloom_header, capacity)] ^= 1;
+	res |= !bloom_deserialize(&rejected, buf, bf->total_size, false);
+	buf[offsetof(bloom_header, capacity)] ^= 1;
+	buf[bf->total_size - 1] ^= 1;
+	res |= !bloom_deserialize(&rejected, buf, bf->total_size, true);
+	res |= !bloom_deserialize(&rejected, buf, bf->total_size - 1, false);
+
+	printf("Serialize round trip (flags %#x): %s\n", flags, res ? "FAIL" : "ok");
+	bloom_free(bf);
+	free(buf);
+	free(offsets);
+	free(expected);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_mmap(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	char path[] = "/tmp/test_bloom_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "fatal mkstemp error\n");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *expected = calloc(num_elems, 1);
+	uint8_t *results = calloc(num_elems, 1);
+	bloom *bf = bloom_create_mmap(path, 0.01, num_elems, flags);
+	if (!bf || !expected || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(bf, data_array, offsets, num_elems / 2);
+	bloom_test_batch(bf, data_array, offsets, num_elems, expected);
+	// Syncing leaves the data unchecksummed rather than hashing the whole array
+	int res = bloom_sync(bf) || ((bloom_header *) bloom_get_prefix(bf))->data_checksum != 0;
+	bloom_free(bf);
+
+	bloom *mapped = bloom_open_mmap(path, 0);
+	res |= !mapped || bloom_sync(mapped) != -1;
+	if (mapped) {
+		bloom_test_batch(mapped, data_array, offsets, num_elems, results);
+		res |= memcmp(expected, results, num_elems) || bloom_get_num_elems(mapped) != num_elems / 2;
+
+		// A read only mapping refuses writes instead of faulting on them
+		uint8_t *key = data_array + offsets[num_elems - 1];
+		res |= bloom_add(mapped, key, elem_size) != -1 || bloom_test_and_add(mapped, key, elem_size) != -1
+		       || bloom_add_batch(mapped, key, offsets, 1) != -1 || bloom_add_batch_fixed(mapped, key, elem_size, 1) != -1
+		       || bloom_add_hash(mapped, 0) != -1 || bloom_serialize(mapped) != -1
+		       || bloom_union(mapped, mapped, mapped) != -1 || bloom_get_num_elems(mapped) != num_elems / 2;
+		bloom_free(mapped);
+	}
+
+	printf("Mmap (flags %#x): %s\n", flags, res ? "FAIL" : "ok");
+	unlink(path);
+	free(offsets);
+	free(expected);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_attach(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	bloom *bf = bloom_alloc_ex(0.01, num_elems, NULL, 0, flags);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *expected = calloc(num_elems, 1);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!bf || !expected || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(bf, data_array, offsets, num_elems / 2);
+	bloom_test_batch(bf, data_array, offsets, num_elems, expected);
+
+	bloom_header layout = {
+		.flags = bf->flags,
+		.hash_id = bf->hash_id,
+		.hash_seed = bf->hash_seed,
+		.false_pos_rate = bf->false_pos_rate,
+		.capacity = bf->capacity,
+		.num_elems = bloom_get_num_elems(bf),
+		.num_partitions = bf->num_partitions,
+		.num_blocks = bf->num_blocks,
+		.size = bf->size,
+	};
+	bloom attached;
+	int res = bloom_init_layout(&attached, &layout, bf->partition_lengths, bf->base_ptr, bf->total_size);
+	if (!res) {
+		bloom_test_batch(&attached, data_array, offsets, num_elems, results);
+		res |= memcmp(expected, results, num_elems) || bloom_get_num_elems(&attached) != num_elems / 2;
+		bloom_clear(&attached);
+	}
+	res |= !bloom_init_layout(&attached, &layout, bf->partition_lengths, bf->base_ptr, bf->total_size - 1);
+
+	// A bare array has no header naming its hash, and is attached with the XXH64 every such array was built with,
+	// which a build pinned to another hash refuses
+#if defined(BLOOM_HASH_PINNED) && BLOOM_HASH_DEFAULT != BLOOM_HASH_XXH64
+	res |= !bloom_init_ex(&attached, 0.01, num_elems, bf->bloom_ptr, 0, flags);
+	bloom_clear(&attached);
+#else
+	bloom *legacy = bloom_alloc_ex(0.01, num_elems, NULL, 0, flags);
+	if (!legacy) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	res |= bloom_use_hash(legacy, BLOOM_HASH_XXH64, 0);
+	bloom_add_batch(legacy, data_array, offsets, num_elems / 2);
+	bloom_test_batch(legacy, data_array, offsets, num_elems, expected);
+	if (!bloom_init_ex(&attached, 0.01, num_elems, legacy->bloom_ptr, 0, flags)) {
+		bloom_test_batch(&attached, data_array, offsets, num_elems, results);
+		res |= memcmp(expected, results, num_elems) || attached.hash_id != BLOOM_HASH_XXH64;
+		bloom_clear(&attached);
+	} else {
+		res = -1;
+	}
+	bloom_free(legacy);
+#endif
+
+	printf("Attach from layout (flags %#x): %s\n", flags, res ? "FAIL" : "ok");
+	bloom_free(bf);
+	free(offsets);
+	free(expected);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_scalable(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	bloom_scalable *bs = bloom_scalable_alloc(0.01, 1000, flags);
+	if (!bs) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	uint32_t num_adds = num_elems / 10;
+	uint8_t *data_ptr = data_array;
+	for (uint32_t i = 0; i < num_adds; i++) {
+		bloom_scalable_add(bs, data_ptr, elem_size);
+		data_ptr += elem_size;
+	}
+
+	long missing = 0;
+	data_ptr = data_array;
+	for (uint32_t i = 0; i < num_adds; i++) {
+		missing += bloom_scalable_test(bs, data_ptr, elem_size);
+		data_ptr += elem_size;
+	}
+	long positive = 0;
+	for (uint32_t i = num_adds; i < num_elems; i++) {
+		positive += !bloom_scalable_test(bs, data_ptr, elem_size);
+		data_ptr += elem_size;
+	}
+
+	double rate = (double) positive / (num_elems - num_adds);
+	printf("Scalable (flags %#x): %ld filters | count %ld | missing %ld | fake pos rate %f\n", flags,
+	       bs->num_filters, bloom_scalable_get_num_elems(bs), missing, rate);
+	int res = missing || rate > 0.01 * 1.1 || bloom_scalable_get_num_elems(bs) != num_adds;
+	bloom_scalable_free(bs);
+	return res ? -1 : 0;
+}
+
+int test_bloom_counting(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems)
+{
+	bloom *bf = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, BLOOM_COUNTING);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!bf || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(bf, data_array, offsets, num_elems / 2);
+
+	// Remove the first half of the keys added, the rest must still be present
+	uint32_t num_removed = num_elems / 4;
+	long not_removed = 0;
+	for (uint32_t i = 0; i < num_removed; i++) {
+		not_removed += bloom_remove(bf, data_array + offsets[i], elem_size) != 0;
+	}
+
+	bloom_test_batch(bf, data_array, offsets, num_elems, results);
+	long missing = 0;
+	long positive = 0;
+	for (uint32_t i = num_removed; i < num_elems / 2; i++) {
+		missing += results[i];
+	}
+	for (uint32_t i = 0; i < num_removed; i++) {
+		positive += !results[i];
+	}
+	for (uint32_t i = num_elems / 2; i < num_elems; i++) {
+		positive += !results[i];
+	}
+	double rate = (double) positive / (num_elems - num_elems / 2 + num_removed);
+
+	printf("Counting: missing %ld | failed removes %ld | fake pos rate %f\n", missing, not_removed, rate);
+	int res = missing || not_removed || bloom_get_num_elems(bf) != num_elems / 2 - num_removed;
+	bloom_free(bf);
+	free(offsets);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_merge(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	// a holds keys [0, n / 2), b holds [n / 4, 3n / 4), so a third of their union is shared
+	uint32_t half = num_elems / 2;
+	uint32_t quarter = num_elems / 4;
+	bloom *a = bloom_alloc_ex(0.01, half, NULL, 0, flags);
+	bloom *b = bloom_alloc_ex(0.01, half, NULL, 0, flags);
+	bloom *other = bloom_alloc_ex(0.01, 2 * half, NULL, 0, flags);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!a || !b || !other || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(a, data_array, offsets, half);
+	bloom_add_batch(b, data_array + offsets[quarter], offsets, half);
+
+	bloom_header layout = {
+		.flags = a->flags,
+		.hash_id = a->hash_id,
+		.hash_seed = a->hash_seed,
+		.false_pos_rate = a->false_pos_rate,
+		.capacity = a->capacity * 2,
+		.num_partitions = a->num_partitions,
+		.num_blocks = a->num_blocks,
+	};
+	bloom both, either;
+	int res = bloom_init_layout(&both, &layout, a->partition_lengths, NULL, 0);
+	res |= bloom_init_layout(&either, &layout, a->partition_lengths, NULL, 0);
+	res |= bloom_intersect(&both, a, b);
+	res |= bloom_jaccard_estimate(a, other) != -1.0 || bloom_union(a, a, other) != -1;
+
+	// Every kernel must produce the union the scalar one does
+	double jaccard = bloom_jaccard_estimate(a, b);
+	uint8_t *scalar_union = malloc(a->size);
+	if (!scalar_union) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int kernel = BLOOM_KERNEL_SCALAR; kernel <= BLOOM_KERNEL_AVX512; kernel++) {
+		if (bloom_select_kernel(kernel)) {
+			continue;
+		}
+		res |= bloom_union(&either, a, b);
+		if (kernel == BLOOM_KERNEL_SCALAR) {
+			memcpy(scalar_union, either.bloom_ptr, a->size);
+		}
+		res |= memcmp(scalar_union, either.bloom_ptr, a->size) != 0;
+	}
+	bloom_select_kernel(BLOOM_KERNEL_AUTO);
+	free(scalar_union);
+
+	long missing = 0;
+	bloom_test_batch(&either, data_array, offsets, half + quarter, results);
+	for (uint32_t i = 0; i < half + quarter; i++) {
+		missing += results[i];
+	}
+	bloom_test_batch(&both, data_array + offsets[quarter], offsets, quarter, results);
+	for (uint32_t i = 0; i < quarter; i++) {
+		missing += results[i];
+	}
+
+	printf("Merge (flags %#x): union count %ld of %u | intersection count %ld of %u | jaccard %.3f of 0.333 | "
+	       "missing %ld\n", flags, bloom_get_num_elems(&either), half + quarter, bloom_get_num_elems(&both),
+	       quarter, jaccard, missing);
+	res |= missing || fabs(jaccard - 1.0 / 3) > 0.05;
+	bloom_clear(&both);
+	bloom_clear(&either);
+	bloom_free(a);
+	bloom_free(b);
+	bloom_free(other);
+	free(offsets);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_estimate(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	// Three quarters of the capacity in distinct keys, each added four times
+	uint32_t capacity = num_elems / 8;
+	uint32_t distinct = capacity / 4 * 3;
+	bloom *scanned = bloom_alloc_ex(0.01, capacity, NULL, 0, flags);
+	bloom *tracked = bloom_alloc_ex(0.01, capacity, NULL, 0, flags | BLOOM_TRACK_FILL);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!scanned || !tracked || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int round = 0; round < 4; round++) {
+		bloom_add_batch(scanned, data_array, offsets, distinct);
+		for (uint32_t i = 0; i < distinct; i++) {
+			bloom_add(tracked, data_array + offsets[i], elem_size);
+		}
+	}
+
+	uint64_t scan_estimate = bloom_estimate_count(scanned);
+	uint64_t track_estimate = bloom_estimate_count(tracked);
+
+	bloom_test_batch(scanned, data_array + offsets[distinct], offsets, num_elems - distinct, results);
+	long positive = 0;
+	for (uint32_t i = 0; i < num_elems - distinct; i++) {
+		positive += !results[i];
+	}
+	double rate = (double) positive / (num_elems - distinct);
+	double expected_rate = bloom_current_fpr(scanned);
+
+	printf("Estimate (flags %#x): adds %ld | distinct %u | estimate %lu (tracked %lu) | remaining %lu | fpr %.6f "
+	       "expected %.6f\n", flags, bloom_get_num_elems(scanned), distinct, scan_estimate, track_estimate,
+	       bloom_remaining_capacity(tracked), rate, expected_rate);
+	int res = scan_estimate != track_estimate || fabs((double) scan_estimate / distinct - 1) > 0.02
+	          || bloom_current_fpr(tracked) != expected_rate || fabs(rate / expected_rate - 1) > 0.2;
+
+	// An attach leaves the fill to be counted on the first estimate, so it does not read the whole array
+	bloom_header layout = {
+		.flags = tracked->flags,
+		.hash_id = tracked->hash_id,
+		.hash_seed = tracked->hash_seed,
+		.false_pos_rate = tracked->false_pos_rate,
+		.capacity = tracked->capacity,
+		.num_partitions = tracked->num_partitions,
+		.num_blocks = tracked->num_blocks,
+		.size = tracked->size,
+	};
+	bloom attached;
+	res |= bloom_init_layout(&attached, &layout, tracked->partition_lengths, tracked->base_ptr, tracked->total_size);
+	res |= !attached.fill_pending || bloom_estimate_count(&attached) != track_estimate || attached.fill_pending;
+	bloom_clear(&attached);
+
+	bloom_free(scanned);
+	bloom_free(tracked);
+	free(offsets);
+	free(results);
+	return res ? -1 : 0;
+}
+
+uint64_t test_hash_fnv1a(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	}
+	// FNV leaves the high bits poorly mixed, and those pick the block of a blocked filter
+	return hash ^ hash >> 29;
+}
+
+int test_bloom_hash(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	static const struct {
+		uint32_t id;
+		uint64_t seed;
+		const char *name;
+	} hashes[] = {
+		{BLOOM_HASH_XXH64, 0, "xxh64"},
+		{BLOOM_HASH_XXH3, 0, "xxh3"},
+		{BLOOM_HASH_XXH3, 0x9e3779b97f4a7c15ULL, "xxh3 seeded"},
+		{BLOOM_HASH_CUSTOM, 0, "fnv1a"},
+	};
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *expected = calloc(num_elems, 1);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!expected || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	int res = bloom_register_hash(BLOOM_HASH_CUSTOM, test_hash_fnv1a);
+	res |= !bloom_register_hash(BLOOM_HASH_XXH3, test_hash_fnv1a);
+
+	for (size_t h = 0; h < sizeof hashes / sizeof *hashes; h++) {
+		bloom *bf = bloom_alloc_ex(0.01, num_elems / 2, NULL, BLOOM_HEADER_MAX_LEN, flags);
+		if (!bf) {
+			fprintf(stderr, "fatal alloc error\n");
+			exit(EXIT_FAILURE);
+		}
+		int hash_res = bloom_use_hash(bf, hashes[h].id, hashes[h].seed);
+#ifdef BLOOM_HASH_PINNED
+		if (hashes[h].id != BLOOM_HASH_DEFAULT) {
+			printf("Hash %-11s (flags %#x): refused by the pinned build | %s\n", hashes[h].name, flags,
+			       hash_res ? "ok" : "FAIL");
+			res |= !hash_res;
+			bloom_free(bf);
+			continue;
+		}
+#endif
+		bloom_add_batch(bf, data_array, offsets, num_elems / 2);
+		hash_res |= !bloom_use_hash(bf, BLOOM_HASH_XXH64, 0);
+
+		uint8_t *data_ptr = data_array;
+		long pos = 0;
+		for (uint32_t i = 0; i < num_elems; i++) {
+			pos += !bloom_test(bf, data_ptr, elem_size);
+			data_ptr += elem_size;
+		}
+		bloom_test_batch(bf, data_array, offsets, num_elems, expected);
+		for (uint32_t i = 0; i < num_elems / 2; i++) {
+			hash_res |= expected[i];
+		}
+
+		// The hash travels with the serialized filter, and a filter naming an unknown hash is refused
+		hash_res |= bloom_serialize(bf);
+		bloom loaded;
+		hash_res |= bloom_deserialize(&loaded, bloom_get_prefix(bf), bf->total_size, true);
+		if (!hash_res) {
+			bloom_test_batch(&loaded, data_array, offsets, num_elems, results);
+			hash_res |= memcmp(expected, results, num_elems) || loaded.hash_id != hashes[h].id
+			            || loaded.hash_seed != hashes[h].seed;
+			bloom_clear(&loaded);
+		}
+		bloom_header layout = {
+			.flags = bf->flags,
+			.hash_id = BLOOM_HASH_CUSTOM + 1,
+			.num_partitions = bf->num_partitions,
+			.num_blocks = bf->num_blocks,
+		};
+		hash_res |= !bloom_init_layout(&loaded, &layout, bf->partition_lengths, NULL, 0);
+
+		printf("Hash %-11s (flags %#x): pos rate %f | %s\n", hashes[h].name, flags,
+		       (double) (pos - num_elems / 2) / (num_elems - num_elems / 2), hash_res ? "FAIL" : "ok");
+		res |= hash_res;
+		bloom_free(bf);
+	}
+
+	free(offsets);
+	free(expected);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_many(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	enum { num_filters = 12 };
+	uint32_t per_filter = num_elems / 2 / num_filters;
+	bloom *filters[num_filters];
+	uint8_t results[num_filters];
+	for (int f = 0; f < num_filters; f++) {
+		filters[f] = bloom_alloc_ex(0.01, per_filter, NULL, 0, flags);
+		if (!filters[f]) {
+			fprintf(stderr, "fatal alloc error\n");
+			exit(EXIT_FAILURE);
+		}
+		// Two in three filters are built from precomputed hashes, one at a time or in a batch, which must set
+		// the same bits as bloom_add
+		uint8_t *data_ptr = data_array + (uint64_t) f * per_filter * elem_size;
+		uint64_t *hashes = malloc(per_filter * sizeof *hashes);
+		for (uint32_t i = 0; i < per_filter; i++) {
+			if (f % 3 == 1) {
+				bloom_add_hash(filters[f], bloom_key_hash(filters[f], data_ptr, elem_size));
+			} else if (f % 3 == 2) {
+				hashes[i] = bloom_key_hash(filters[f], data_ptr, elem_size);
+			} else {
+				bloom_add(filters[f], data_ptr, elem_size);
+			}
+			data_ptr += elem_size;
+		}
+		if (f % 3 == 2) {
+			bloom_add_hash_batch(filters[f], hashes, per_filter);
+		}
+		free(hashes);
+	}
+
+	uint8_t *data_ptr = data_array;
+	long mismatch = 0, missing = 0;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		bloom_test_many(filters, num_filters, data_ptr, elem_size, results);
+		missing += i < per_filter * num_filters && results[i / per_filter];
+		uint64_t hash = bloom_key_hash(filters[0], data_ptr, elem_size);
+		for (int f = 0; f < num_filters; f++) {
+			mismatch += results[f] != bloom_test(filters[f], data_ptr, elem_size)
+			            || results[f] != bloom_test_hash(filters[f], hash);
+		}
+		data_ptr += elem_size;
+	}
+
+	// Filters hashing keys differently cannot share one hash. A pinned build cannot hold such filters at all.
+	int res = 0;
+#ifndef BLOOM_HASH_PINNED
+	bloom *other = bloom_alloc_ex(0.01, per_filter, NULL, 0, flags);
+	res = bloom_use_hash(other, filters[0]->hash_id == BLOOM_HASH_XXH64 ? BLOOM_HASH_XXH3 : BLOOM_HASH_XXH64, 0);
+	bloom *last = filters[num_filters - 1];
+	filters[num_filters - 1] = other;
+	res |= !bloom_test_many(filters, num_filters, data_array, elem_size, results);
+	filters[num_filters - 1] = last;
+	bloom_free(other);
+#endif
+
+	printf("Test many (%d filters, flags %#x): missing %ld | %s\n", num_filters, flags, missing,
+	       mismatch || res ? "MISMATCH" : "match");
+	for (int f = 0; f < num_filters; f++) {
+		bloom_free(filters[f]);
+	}
+	return missing || mismatch || res ? -1 : 0;
+}
+
+int test_bloom_huge_pages(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	static const char *pages[] = {"4KB", "THP", "2MB", "1GB"};
+	bloom *bf = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, flags);
+	bloom *huge = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, flags | BLOOM_HUGE_PAGES);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *expected = calloc(num_elems, 1);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!bf || !huge || !expected || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(bf, data_array, offsets, num_elems / 2);
+	bloom_add_batch(huge, data_array, offsets, num_elems / 2);
+
+	bloom_test_batch(bf, data_array, offsets, num_elems, expected);
+	bloom_test_batch(huge, data_array, offsets, num_elems, results);
+
+	int res = huge->size != bf->size || memcmp(huge->bloom_ptr, bf->bloom_ptr, bf->size)
+	          || memcmp(expected, results, num_elems) || (uintptr_t) huge->bloom_ptr % BLOOM_BLOCK_BYTES;
+	printf("Huge pages (flags %#x): %s pages | %s\n", flags, pages[huge->pages], res ? "MISMATCH" : "match");
+	bloom_free(bf);
+	bloom_free(huge);
+	free(offsets);
+	free(expected);
+	free(results);
+	return res ? -1 : 0;
+}
+
+int test_bloom_replicated(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	bloom_replicated *br = bloom_replicated_alloc(0.01, num_elems / 2, flags);
+	bloom *bf = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, flags);
+	if (!br || !bf) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint8_t *data_ptr = data_array;
+	for (uint32_t i = 0; i < num_elems / 2; i++) {
+		bloom_replicated_add(br, data_ptr, elem_size);
+		bloom_add(bf, data_ptr, elem_size);
+		data_ptr += elem_size;
+	}
+	int res = bloom_replicated_publish(br);
+
+	for (uint64_t r = 0; r < br->num_replicas; r++) {
+		res |= memcmp(br->replicas[r].bloom_ptr, bf->bloom_ptr, bf->size)
+		       || bloom_get_num_elems(&br->replicas[r]) != num_elems / 2;
+	}
+	data_ptr = data_array;
+	long mismatch = 0;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		mismatch += bloom_replicated_test(br, data_ptr, elem_size) != bloom_test(bf, data_ptr, elem_size);
+		data_ptr += elem_size;
+	}
+	res |= mismatch || bloom_replicated_alloc(0.01, num_elems, BLOOM_COUNTING) != NULL;
+
+	printf("Replicated (flags %#x): %lu replicas over %lu nodes, %s | %s\n", flags, br->num_replicas,
+	       br->num_nodes, br->node_local ? "node local" : "NOT node local", res ? "FAIL" : "ok");
+	bloom_replicated_free(br);
+	bloom_free(bf);
+	return res ? -1 : 0;
+}
+
+int test_bloom_build_parallel(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	bloom *serial = bloom_alloc_ex(0.01, num_elems, NULL, 0, flags);
+	if (!serial) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(serial, data_array, offsets, num_elems);
+
+	int res = 0;
+	uint32_t thread_counts[] = {2, test_num_threads, 7};
+	for (int t = 0; t < 3; t++) {
+		bloom *bf = bloom_alloc_ex(0.01, num_elems, NULL, 0, flags);
+		if (!bf) {
+			fprintf(stderr, "fatal alloc error\n");
+			exit(EXIT_FAILURE);
+		}
+		int build_res = bloom_build_parallel(bf, data_array, offsets, num_elems, thread_counts[t]);
+
+		build_res |= memcmp(bf->bloom_ptr, serial->bloom_ptr, bf->size)
+		             || bloom_get_num_elems(bf) != bloom_get_num_elems(serial)
+		             || (bf->partition_fill && memcmp(bf->partition_fill, serial->partition_fill,
+		                                              bf->num_partitions * sizeof(uint64_t)));
+		printf("Parallel build (flags %#x, %u threads): %s\n", flags, thread_counts[t],
+		       build_res ? "MISMATCH" : "identical");
+		res |= build_res;
+		bloom_free(bf);
+	}
+
+	// A zero length key in the third chunk fails the build, leaving the first two chunks added and counted
+	uint64_t built = 2 * BLOOM_BUILD_CHUNK;
+	bloom *partial = bloom_alloc_ex(0.01, num_elems, NULL, 0, flags);
+	bloom *expected = bloom_alloc_ex(0.01, num_elems, NULL, 0, flags);
+	if (!partial || !expected) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	offsets[built + 11] = offsets[built + 10];
+	int partial_res = bloom_build_parallel(partial, data_array, offsets, num_elems, test_num_threads) != -1;
+	bloom_add_batch(expected, data_array, offsets, built);
+	partial_res |= memcmp(partial->bloom_ptr, expected->bloom_ptr, partial->size)
+	               || bloom_get_num_elems(partial) != built
+	               || (partial->partition_fill && memcmp(partial->partition_fill, expected->partition_fill,
+	                                                     partial->num_partitions * sizeof(uint64_t)));
+	printf("Parallel build failing in chunk 3 (flags %#x): %s\n", flags, partial_res ? "MISMATCH" : "partial");
+	res |= partial_res;
+	bloom_free(partial);
+	bloom_free(expected);
+
+	bloom_free(serial);
+	free(offsets);
+	return res ? -1 : 0;
+}
+
+typedef struct test_dedup_arg {
+	bloom *bf;
+	uint8_t *data;
+	uint32_t num_elems;
+	uint8_t *fresh;
+} test_dedup_arg;
+
+void *test_concurrent_dedup(void *arg)
+{
+	test_dedup_arg *t = arg;
+	for (uint32_t i = 0; i < t->num_elems; i++) {
+		t->fresh[i] = bloom_test_and_add(t->bf, t->data + (uint64_t) i * key_size, key_size);
+	}
+	return NULL;
+}
+
+int test_bloom_test_and_add(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	// The stream holds every key twice: the first half of the keys, then the same keys starting with the last,
+	// which the batch sees twice in a row
+	uint32_t half = num_elems / 2;
+	uint64_t *offsets = test_generate_offsets(elem_size, 2 * half);
+	uint8_t *stream = malloc(2ULL * half * elem_size);
+	uint8_t *results = malloc(2ULL * half);
+	bloom *seq = bloom_alloc_ex(0.01, half, NULL, 0, flags);
+	bloom *fused = bloom_alloc_ex(0.01, half, NULL, 0, flags);
+	bloom *batch = bloom_alloc_ex(0.01, half, NULL, 0, flags);
+	if (!stream || !results || !seq || !fused || !batch) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(stream, data_array, (uint64_t) half * elem_size);
+	memcpy(stream + (uint64_t) half * elem_size, data_array + (uint64_t) (half - 1) * elem_size, elem_size);
+	memcpy(stream + (uint64_t) (half + 1) * elem_size, data_array, (uint64_t) (half - 1) * elem_size);
+
+	long seq_new = 0, fused_new = 0, batch_new = 0, mismatch = 0;
+	for (uint32_t i = 0; i < 2 * half; i++) {
+		uint8_t *key = stream + offsets[i];
+		if (bloom_test(seq, key, elem_size)) {
+			bloom_add(seq, key, elem_size);
+			seq_new++;
+		}
+	}
+	for (uint32_t i = 0; i < 2 * half; i++) {
+		fused_new += bloom_test_and_add(fused, stream + offsets[i], elem_size);
+	}
+	bloom_test_and_add_batch(batch, stream, offsets, 2 * half, results);
+	for (uint32_t i = 0; i < 2 * half; i++) {
+		batch_new += results[i];
+		mismatch += i >= half && results[i];
+	}
+
+	mismatch += seq_new != fused_new || fused_new != batch_new || bloom_get_num_elems(fused) != (uint64_t) fused_new
+	            || bloom_get_num_elems(batch) != (uint64_t) batch_new
+	            || memcmp(fused->bloom_ptr, batch->bloom_ptr, fused->size)
+	            || memcmp(seq->bloom_ptr, fused->bloom_ptr, seq->size);
+	printf("Test and add (flags %#x): new %ld of %u | %s\n", flags, fused_new, half, mismatch ? "MISMATCH" : "match");
+	bloom_free(seq);
+	bloom_free(fused);
+	bloom_free(batch);
+	free(results);
+	free(offsets);
+	free(stream);
+
+	// Threads racing to add the same keys into a concurrent filter: each key is new to at least one of them,
+	// except for the false positives of a filling filter (under p on average)
+	long present = 0;
+	if (flags & BLOOM_CONCURRENT) {
+		bloom *bf = bloom_alloc_ex(0.01, half, NULL, 0, flags);
+		pthread_t threads[test_num_threads];
+		test_dedup_arg args[test_num_threads];
+		for (int i = 0; i < test_num_threads; i++) {
+			args[i] = (test_dedup_arg) {bf, data_array, half, malloc(half)};
+			pthread_create(&threads[i], NULL, test_concurrent_dedup, &args[i]);
+		}
+		long total = 0;
+		for (int i = 0; i < test_num_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		for (uint32_t j = 0; j < half; j++) {
+			long fresh = 0;
+			for (int i = 0; i < test_num_threads; i++) {
+				fresh += args[i].fresh[j];
+			}
+			present += !fresh;
+			total += fresh;
+		}
+		printf("Concurrent test and add (%d threads): new %ld | count %lu | already present %ld of %u\n",
+		       test_num_threads, total, bloom_get_num_elems(bf), present, half);
+		mismatch += present > half / 50 || bloom_get_num_elems(bf) != (uint64_t) total;
+		for (int i = 0; i < test_num_threads; i++) {
+			free(args[i].fresh);
+		}
+		bloom_free(bf);
+	}
+	return mismatch ? -1 : 0;
+}
+
+int test_bloom_fixed(uint8_t *data_array, uint32_t num_elems, uint32_t flags)
+{
+	static const uint32_t widths[] = {4, 8, 16, 32};
+	uint8_t *results = malloc(num_elems);
+	int res = 0;
+	for (int w = 0; w < 4; w++) {
+		uint32_t width = widths[w];
+		bloom *generic = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, flags);
+		bloom *fixed = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, flags);
+		bloom *batch = bloom_alloc_ex(0.01, num_elems / 2, NULL, 0, flags);
+		if (!results || !generic || !fixed || !batch) {
+			fprintf(stderr, "fatal alloc error\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (uint32_t i = 0; i < num_elems / 2; i++) {
+			bloom_add(generic, data_array + (uint64_t) i * width, width);
+		}
+		for (uint32_t i = 0; i < num_elems / 2; i++) {
+			uint8_t *key = data_array + (uint64_t) i * width;
+			uint32_t u32;
+			uint64_t u64;
+			switch (width) {
+			case 4: memcpy(&u32, key, 4); bloom_add_u32(fixed, u32); break;
+			case 8: memcpy(&u64, key, 8); bloom_add_u64(fixed, u64); break;
+			case 16: bloom_add_fixed16(fixed, key); break;
+			default: bloom_add_fixed32(fixed, key);
+			}
+		}
+		bloom_add_batch_fixed(batch, data_array, width, num_elems / 2);
+
+		long mismatch = memcmp(generic->bloom_ptr, fixed->bloom_ptr, generic->size)
+		                || memcmp(generic->bloom_ptr, batch->bloom_ptr, generic->size)
+		                || bloom_get_num_elems(batch) != num_elems / 2;
+		long positive = 0;
+		for (uint32_t i = 0; i < num_elems; i++) {
+			positive += !bloom_test(generic, data_array + (uint64_t) i * width, width);
+		}
+		long fixed_positive = 0;
+		for (uint32_t i = 0; i < num_elems; i++) {
+			uint8_t *key = data_array + (uint64_t) i * width;
+			uint32_t u32;
+			uint64_t u64;
+			switch (width) {
+			case 4: memcpy(&u32, key, 4); fixed_positive += !bloom_test_u32(fixed, u32); break;
+			case 8: memcpy(&u64, key, 8); fixed_positive += !bloom_test_u64(fixed, u64); break;
+			case 16: fixed_positive += !bloom_test_fixed16(fixed, key); break;
+			default: fixed_positive += !bloom_test_fixed32(fixed, key);
+			}
+		}
+		bloom_test_batch_fixed(batch, data_array, width, num_elems, results);
+		for (uint32_t i = 0; i < num_elems; i++) {
+			mismatch += !results[i] != !bloom_test(generic, data_array + (uint64_t) i * width, width);
+		}
+		mismatch += positive != fixed_positive;
+
+		printf("Fixed width %u (flags %#x): %s\n", width, flags, mismatch ? "MISMATCH" : "match");
+		res |= mismatch ? -1 : 0;
+		bloom_free(generic);
+		bloom_free(fixed);
+		bloom_free(batch);
+	}
+	free(results);
+	return res;
+}
+
+int test_bloom_large(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	uint32_t half = num_elems / 2;
+	bloom *scalar = bloom_alloc_ex(0.01, half, NULL, BLOOM_HEADER_MAX_LEN, flags | BLOOM_LARGE);
+	bloom *batch = bloom_alloc_ex(0.01, half, NULL, 0, flags | BLOOM_LARGE);
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *results = calloc(num_elems, 1);
+	if (!scalar || !batch || !results) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < half; i++) {
+		bloom_add(scalar, data_array + (uint64_t) i * elem_size, elem_size);
+	}
+	bloom_add_batch(batch, data_array, offsets, half);
+
+	long mismatch = memcmp(scalar->bloom_ptr, batch->bloom_ptr, scalar->size);
+	long false_pos = 0;
+	for (uint32_t i = 0; i < num_elems; i++) {
+		int absent = bloom_test(scalar, data_array + (uint64_t) i * elem_size, elem_size);
+		mismatch += i < half && absent;
+		false_pos += i >= half && !absent;
+	}
+	bloom_test_batch(batch, data_array, offsets, num_elems, results);
+	for (uint32_t i = 0; i < num_elems; i++) {
+		mismatch += !results[i] != !bloom_test(scalar, data_array + (uint64_t) i * elem_size, elem_size);
+	}
+	double fpr = (double) false_pos / (num_elems - half);
+	mismatch += fpr > 0.02;
+
+	// Keys already present are reported as such and leave the filter untouched
+	bloom_test_and_add_batch(batch, data_array, offsets, half, results);
+	for (uint32_t i = 0; i < half; i++) {
+		mismatch += results[i];
+	}
+	mismatch += memcmp(scalar->bloom_ptr, batch->bloom_ptr, scalar->size) || bloom_get_num_elems(batch) != half;
+
+	// The pre-hashed functions only have 64 bits to work with
+	uint64_t hash = bloom_key_hash(scalar, data_array, elem_size);
+	mismatch += !bloom_add_hash(batch, hash) || !bloom_test_hash(batch, hash) || !bloom_add_hash_batch(batch, &hash, 1);
+	mismatch += bloom_alloc_ex(0.01, half, NULL, 0, BLOOM_LARGE | BLOOM_BLOCKED) != NULL;
+	mismatch += bloom_alloc_ex(1.0, half, NULL, 0, BLOOM_LARGE) != NULL || bloom_alloc_ex(NAN, half, NULL, 0, 0) != NULL;
+
+	int res = bloom_serialize(scalar);
+	bloom loaded;
+	res |= bloom_deserialize(&loaded, bloom_get_prefix(scalar), scalar->total_size, true);
+	if (!res) {
+		res |= !(loaded.flags & BLOOM_LARGE);
+		for (uint32_t i = 0; i < num_elems; i++) {
+			uint8_t *key = data_array + (uint64_t) i * elem_size;
+			res |= !bloom_test(&loaded, key, elem_size) != !bloom_test(scalar, key, elem_size);
+		}
+		bloom_clear(&loaded);
+	}
+	mismatch += res != 0;
+
+	if (flags & BLOOM_COUNTING) {
+		for (uint32_t i = 0; i < half; i++) {
+			mismatch += bloom_remove(batch, data_array + (uint64_t) i * elem_size, elem_size) != 0;
+		}
+		for (uint32_t i = 0; i < half; i++) {
+			mismatch += !bloom_test(batch, data_array + (uint64_t) i * elem_size, elem_size);
+		}
+	}
+
+	printf("Large mode (flags %#x): fake pos rate %f | %s\n", flags, fpr, mismatch ? "MISMATCH" : "match");
+	bloom_free(scalar);
+	bloom_free(batch);
+	free(offsets);
+	free(results);
+	return mismatch ? -1 : 0;
+}
+
+int test_bloom_aligned(uint8_t *data_array, uint32_t elem_size, uint32_t num_elems, uint32_t flags)
+{
+	static const uint32_t aligns[] = {BLOOM_ALIGN_WORDS, BLOOM_ALIGN_LINES};
+	uint32_t half = num_elems / 2;
+	uint64_t *offsets = test_generate_offsets(elem_size, num_elems);
+	uint8_t *expected = calloc(num_elems, 1);
+	uint8_t *results = calloc(num_elems, 1);
+	bloom *packed = bloom_alloc_ex(0.01, half, NULL, 0, flags);
+	if (!offsets || !expected || !results || !packed) {
+		fprintf(stderr, "fatal alloc error\n");
+		exit(EXIT_FAILURE);
+	}
+	bloom_add_batch(packed, data_array, offsets, half);
+	bloom_test_batch(packed, data_array, offsets, num_elems, expected);
+
+	int res = 0;
+	for (int a = 0; a < 2; a++) {
+		bloom *bf = bloom_alloc_ex(0.01, half, NULL, BLOOM_HEADER_MAX_LEN, flags | aligns[a]);
+		if (!bf) {
+			fprintf(stderr, "fatal alloc error\n");
+			exit(EXIT_FAILURE);
+		}
+		// Partitions keep their lengths, and so every key its slot in each, only their offsets are padded
+		uint64_t align_slots = (aligns[a] == BLOOM_ALIGN_LINES ? BLOOM_BLOCK_BITS : 64)
+		                       / (flags & BLOOM_COUNTING ? BLOOM_COUNTER_BITS : 1);
+		long mismatch = (uintptr_t) bf->bloom_ptr % 8 || bf->size % 8 || bf->size < packed->size;
+		for (uint64_t i = 0; i < bf->num_partitions; i++) {
+			mismatch += bf->partition_offsets[i] % align_slots != 0;
+		}
+
+		for (uint32_t i = 0; i < half; i++) {
+			bloom_add(bf, data_array + (uint64_t) i * elem_size, elem_size);
+		}
+		bloom_test_batch(bf, data_array, offsets, num_elems, results);
+		for (uint32_t i = 0; i < num_elems; i++) {
+			uint8_t *key = data_array + (uint64_t) i * elem_size;
+			mismatch += results[i] != expected[i] || !bloom_test(bf, key, elem_size) != !expected[i];
+		}
+		mismatch += bloom_estimate_count(bf) != bloom_estimate_count(packed);
+
+		// The layout travels in the header flags
+		bloom loaded;
+		if (bloom_serialize(bf) || bloom_deserialize(&loaded, bloom_get_prefix(bf), bf->total_size, true)) {
+			mismatch++;
+		} else {
+			mismatch += loaded.flags != bf->flags || loaded.size != bf->size;
+			bloom_test_batch(&loaded, data_array, offsets, num_elems, results);
+			mismatch += memcmp(results, expected, num_elems) != 0;
+			bloom_clear(&loaded);
+		}
+
+		if (flags & BLOOM_COUNTING) {
+			for (uint32_t i = 0; i < half; i += 2) {
+				mismatch += bloom_remove(bf, data_array + (uint64_t) i * elem_size, elem_size) != 0;
+			}
+			for (uint32_t i = 0; i < half; i++) {
+				int absent = bloom_test(bf, data_array + (uint64_t) i * elem_size, elem_size);
+				mismatch += i % 2 && absent;
+			}
+		}
+
+		printf("Aligned partitions (%s, flags %#x): %lu -> %lu bytes | %s\n",
+		       aligns[a] == BLOOM_ALIGN_LINES ? "lines" : "words", flags, packed->size, bf->size,
+		       mismatch ? "MISMATCH" : "match");
+		res |= mismatch ? -1 : 0;
+		bloom_free(bf);
+	}
+
+	res |= bloom_alloc_ex(0.01, half, NULL, 0, BLOOM_ALIGN_WORDS | BLOOM_ALIGN_LINES) != NULL
+	       || bloom_alloc_ex(0.01, half, NULL, 0, BLOOM_ALIGN_WORDS | BLOOM_BLOCKED) != NULL;
+	bloom_free(packed);
+	free(offsets);
+	free(expected);
+	free(results);
+	return res;
+}
+
 int main(int argc, char **argv)
 {
     bloom *bf = test_bf_setup(0.01);
 	uint8_t* data = test_generate_data(key_size, test_num_elems);
 	uint8_t* false_lookup_data = test_generate_data(key_size, test_num_lookups);
+    int failures = 0;
     bloom_print(bf);
     test_bloom_add(bf, data, key_size, test_num_elems);
     test_bloom_lookup(bf, data, key_size, test_num_elems, "Real data");
+    failures += test_bloom_positions(bf, data, key_size, test_num_elems) != 0;
+    failures += test_bloom_partitions() != 0;
+    failures += test_bloom_prime_window() != 0;
     test_bloom_lookup(bf, false_lookup_data, key_size, test_num_lookups, "Fake data");
+    failures += test_bloom_batch(false_lookup_data, key_size, test_num_keys) != 0;
+    failures += test_bloom_concurrent(false_lookup_data, test_num_keys) != 0;
+    failures += test_bloom_sharded(false_lookup_data, test_num_keys, 16, 0, BLOOM_HASH_DEFAULT) != 0;
+#ifdef BLOOM_HASH_PINNED
+    failures += test_bloom_sharded(false_lookup_data, test_num_keys, 16, BLOOM_LARGE, BLOOM_HASH_DEFAULT) != 0;
+#else
+    failures += test_bloom_sharded(false_lookup_data, test_num_keys, 16, BLOOM_LARGE, BLOOM_HASH_XXH3) != 0;
+#endif
+    failures += test_bloom_kernels(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_kernels(false_lookup_data, key_size, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_serialize(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_serialize(false_lookup_data, key_size, test_num_keys,
+                                     BLOOM_BLOCKED | BLOOM_CONCURRENT) != 0;
+    failures += test_bloom_mmap(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_mmap(false_lookup_data, key_size, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_attach(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_attach(false_lookup_data, key_size, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_scalable(false_lookup_data, key_size, test_num_lookups, 0) != 0;
+    failures += test_bloom_scalable(false_lookup_data, key_size, test_num_lookups, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_counting(false_lookup_data, key_size, test_num_keys) != 0;
+    failures += test_bloom_merge(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_merge(false_lookup_data, key_size, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_estimate(false_lookup_data, key_size, test_num_lookups, 0) != 0;
+    failures += test_bloom_estimate(false_lookup_data, key_size, test_num_lookups, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_estimate(false_lookup_data, key_size, test_num_lookups, BLOOM_COUNTING) != 0;
+    failures += test_bloom_hash(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_hash(false_lookup_data, key_size, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_many(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_many(false_lookup_data, key_size, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_huge_pages(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_huge_pages(false_lookup_data, key_size, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_replicated(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_replicated(false_lookup_data, key_size, test_num_keys,
+                                      BLOOM_BLOCKED | BLOOM_HUGE_PAGES) != 0;
+    failures += test_bloom_build_parallel(false_lookup_data, key_size, 4 * BLOOM_BUILD_CHUNK, 0) != 0;
+    failures += test_bloom_build_parallel(false_lookup_data, key_size, 4 * BLOOM_BUILD_CHUNK,
+                                          BLOOM_BLOCKED | BLOOM_TRACK_FILL) != 0;
+    failures += test_bloom_build_parallel(false_lookup_data, key_size, 4 * BLOOM_BUILD_CHUNK,
+                                          BLOOM_COUNTING | BLOOM_TRACK_FILL) != 0;
+    failures += test_bloom_build_parallel(false_lookup_data, key_size, 4 * BLOOM_BUILD_CHUNK,
+                                          BLOOM_CONCURRENT) != 0;
+    failures += test_bloom_test_and_add(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_test_and_add(false_lookup_data, key_size, test_num_keys,
+                                        BLOOM_BLOCKED | BLOOM_TRACK_FILL) != 0;
+    failures += test_bloom_test_and_add(false_lookup_data, key_size, test_num_keys, BLOOM_COUNTING) != 0;
+    failures += test_bloom_test_and_add(false_lookup_data, key_size, test_num_keys, BLOOM_CONCURRENT) != 0;
+    failures += test_bloom_fixed(false_lookup_data, test_num_keys, 0) != 0;
+    failures += test_bloom_fixed(false_lookup_data, test_num_keys, BLOOM_BLOCKED) != 0;
+    failures += test_bloom_large(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_large(false_lookup_data, key_size, test_num_keys, BLOOM_COUNTING) != 0;
+    failures += test_bloom_aligned(false_lookup_data, key_size, test_num_keys, 0) != 0;
+    failures += test_bloom_aligned(false_lookup_data, key_size, test_num_keys, BLOOM_COUNTING) != 0;
+    failures += test_bloom_aligned(false_lookup_data, key_size, test_num_keys,
+                                   BLOOM_CONCURRENT | BLOOM_TRACK_FILL) != 0;
     bloom_free(bf);
     free(data);
     free(false_lookup_data);
 
-    return 0;
+    return failures ? EXIT_FAILURE : 0;
 }
 
 